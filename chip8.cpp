@@ -5,8 +5,39 @@
 #include <fstream>
 #include <chrono>
 #include <thread>
-#include <random>
+#include <string>
+#include <cstdlib>
+#include <ostream>
+#include <iomanip>
+#include <bitset>
+#include <algorithm>
+#include <deque>
+#include <iterator>
+#include <sstream>
+#include <mutex>
+#include <functional>
+#include <map>
+#include <set>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <cstring>
+#include <type_traits>
+#if defined(__unix__) || defined(__APPLE__)
+#define CHIP8_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifndef CHIP8_HEADLESS
 #include <SDL2/SDL.h>
+#endif
+// The switch build decodes every instruction as it executes, bypassing
+// the decode cache, so it has no compiled blocks either
+#if defined(CHIP8_DISPATCH_SWITCH) && !defined(CHIP8_NO_BLOCKS)
+#define CHIP8_NO_BLOCKS
+#endif
 
 // Constants
 const int MEMORY_SIZE = 4096;
@@ -17,472 +48,5693 @@ const int DISPLAY_WIDTH = 64;
 const int DISPLAY_HEIGHT = 32;
 const int PROGRAM_START = 0x200;
 const int FONTSET_SIZE = 80;
+const int FONT_START = 0x50;
+const int BIG_FONTSET_SIZE = 160;                     // SCHIP / XO-CHIP 8x10 digits, for Fx30
+const int BIG_FONT_START = FONT_START + FONTSET_SIZE; // Right after the small font
 const int PIXEL_SCALE = 10;
-class Chip8
+const uint32_t PIXEL_ON_COLOR = 0xFFFFFFFF;  // ARGB8888
+const uint32_t PIXEL_OFF_COLOR = 0xFF000000; // ARGB8888
+const uint32_t PLANE_COLORS[4] = {PIXEL_OFF_COLOR, PIXEL_ON_COLOR, 0xFFFF8000, 0xFF804000}; // XO-CHIP: by plane bits
+const int FRAME_RATE = 60;
+const int DEFAULT_CPU_HZ = 700;
+const int UNLIMITED_BATCH = 1000; // Cycles between clock checks when running unthrottled
+const int MAX_FRAME_LAG = 5;      // Frames behind schedule before the scheduler resyncs
+const unsigned IDLE_UNTIL_INPUT = ~0u; // Chip8::idleFrames(): only a key change ends the wait
+const int TURBO_CLOCK_INTERVAL = 16; // Turbo frames between clock checks
+const int INPUT_SLICES = 8;          // Paced frames run in this many steps so key events land mid-frame
+const int MAX_BLOCK_LENGTH = 64;  // Instructions per threaded-code block
+const size_t BLOCK_POOL_LIMIT = 16384; // Compiled instructions kept before the block cache is flushed
+const int PAGE_SIZE = 256;        // Granularity of dirty-memory tracking for snapshots
+const int PAGE_COUNT = MEMORY_SIZE / PAGE_SIZE;
+const uint8_t SAVE_STATE_VERSION = 3; // 2: adds the RNG state; 3: adds the machine and its mode state
+const uint64_t DEFAULT_SEED = 0x43484950382D3031ULL;
+const int DEFAULT_REWIND_MB = 16;
+const int AUDIO_SAMPLE_RATE = 44100;
+const int DEFAULT_AUDIO_BUFFER = 512; // Device buffer in samples, ~12 ms
+const int BEEP_HZ = 440;
+const int16_t BEEP_AMPLITUDE = 3000;
+const int AUDIO_HOLD_TICKS = 2; // Ticks the tone is held through an empty queue before going silent
+const int LATENCY_WINDOW_FRAMES = 8; // A key event that changes nothing on screen this soon is not a latency sample
+const int METRICS_INTERVAL_MS = 1000; // Overlay refresh and --metrics line period
+const int OVERLAY_DOT = 3;            // Window pixels per overlay font dot
+const uint32_t OVERLAY_COLOR = 0xFFFFD000; // ARGB8888
+
+// xorshift64* helpers for Cxkk, shared by every core type so a given seed
+// yields the same bytes whichever core runs the ROM.
+inline uint64_t mixSeed(uint64_t seed)
+{
+    // One splitmix64 step spreads similar seeds apart and never yields the
+    // all-zero state xorshift cannot leave
+    uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return (z ^ (z >> 31)) | 1;
+}
+
+inline uint8_t xorshiftNext(uint64_t &state)
+{
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return static_cast<uint8_t>((state * 0x2545F4914F6CDD1DULL) >> 56);
+}
+
+// Read-only bytes of a ROM file. Where mmap is available the file is mapped
+// instead of read, so opening copies nothing and every instance shares the
+// page cache; elsewhere it is read into a buffer once. Images never change
+// after open() and can be shared between threads.
+class RomImage
+{
+public:
+    static std::shared_ptr<const RomImage> open(const std::string &path);
+
+    RomImage(const RomImage &) = delete;
+    RomImage &operator=(const RomImage &) = delete;
+    ~RomImage();
+
+    const uint8_t *data() const
+    {
+        return bytes;
+    }
+
+    size_t size() const
+    {
+        return length;
+    }
+
+private:
+    RomImage() = default;
+
+    const uint8_t *bytes = nullptr;
+    size_t length = 0;
+    bool mapped = false;
+    std::vector<uint8_t> buffer; // Used when the file is not mapped
+};
+
+std::shared_ptr<const RomImage> RomImage::open(const std::string &path)
+{
+    std::shared_ptr<RomImage> image(new RomImage());
+
+#ifdef CHIP8_MMAP
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        std::cerr << "Failed to open ROM: " << path << std::endl;
+        return nullptr;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) < 0)
+    {
+        ::close(fd);
+        std::cerr << "Failed to read ROM: " << path << std::endl;
+        return nullptr;
+    }
+
+    image->length = static_cast<size_t>(info.st_size);
+    if (image->length > 0) // Zero-length mappings are an error
+    {
+        void *view = mmap(nullptr, image->length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (view == MAP_FAILED)
+        {
+            ::close(fd);
+            std::cerr << "Failed to map ROM: " << path << std::endl;
+            return nullptr;
+        }
+        image->bytes = static_cast<const uint8_t *>(view);
+        image->mapped = true;
+    }
+    ::close(fd); // The mapping keeps the file alive
+#else
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open())
+    {
+        std::cerr << "Failed to open ROM: " << path << std::endl;
+        return nullptr;
+    }
+    image->buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    if (file.bad())
+    {
+        std::cerr << "Failed to read ROM: " << path << std::endl;
+        return nullptr;
+    }
+    image->bytes = image->buffer.data();
+    image->length = image->buffer.size();
+#endif
+
+    return image;
+}
+
+RomImage::~RomImage()
+{
+#ifdef CHIP8_MMAP
+    if (mapped)
+    {
+        munmap(const_cast<uint8_t *>(bytes), length);
+    }
+#endif
+}
+
+// Opens each ROM path once and hands every later caller the same image,
+// so batch jobs over one ROM do not each go back to the file system.
+// Safe to call from several threads.
+class RomCache
+{
+public:
+    std::shared_ptr<const RomImage> get(const std::string &path)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::shared_ptr<const RomImage> &image = images[path];
+        if (!image)
+        {
+            image = RomImage::open(path); // Failures stay empty and are retried
+        }
+        return image;
+    }
+
+private:
+    std::mutex mutex;
+    std::map<std::string, std::shared_ptr<const RomImage>> images;
+};
+
+// FNV-1a over values fed as little-endian bytes
+class StateHash
+{
+public:
+    void mix(uint64_t value, int bytes)
+    {
+        for (int i = 0; i < bytes; ++i)
+        {
+            hash = (hash ^ ((value >> (8 * i)) & 0xFF)) * 0x100000001B3ULL;
+        }
+    }
+
+    uint64_t value() const
+    {
+        return hash;
+    }
+
+private:
+    uint64_t hash = 0xCBF29CE484222325ULL;
+};
+
+#ifdef CHIP8_PROFILE
+// Execution profile of one Chip8, built with -DCHIP8_PROFILE and attached
+// with Chip8::setProfile. Counts every executed instruction by opcode and
+// by address, times Dxyn, and keeps a shadow call stack of 2nnn targets so
+// time can be attributed to subroutines. Without the macro none of this,
+// nor the hooks in the core, is compiled.
+class InstructionProfile
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    InstructionProfile()
+    {
+        nodes.push_back(CallNode{0, 0, 0});
+    }
+
+    // Called before each instruction executes
+    void record(uint16_t address, uint16_t opcode)
+    {
+        ++opcodes[opcode];
+        ++addresses[address];
+        lastOpcode[address] = opcode;
+        ++nodes[current].self;
+
+        if ((opcode & 0xF000) == 0x2000)
+        {
+            enter(opcode & 0x0FFF);
+        }
+        else if (opcode == 0x00EE && current != 0)
+        {
+            current = nodes[current].parent;
+            --depth;
+        }
+    }
+
+    void skipped(unsigned long long cycles)
+    {
+        waitCycles += cycles;
+    }
+
+    void drew(Clock::duration elapsed)
+    {
+        ++draws;
+        drawTime += elapsed;
+    }
+
+    // The call stack no longer matches (state load, rewind, reset)
+    void unwind()
+    {
+        current = 0;
+        depth = 0;
+    }
+
+    void writeReport(std::ostream &out) const;
+    void writeCollapsedStacks(std::ostream &out) const;
+
+private:
+    static const int HOT_ADDRESSES = 32;
+
+    // One per distinct call path; node 0 is the top level
+    struct CallNode
+    {
+        uint32_t parent;
+        uint16_t entry;
+        unsigned long long self; // Instructions executed with this path on top
+    };
+
+    std::array<unsigned long long, 0x10000> opcodes{};
+    std::array<unsigned long long, 0x10000> addresses{}; // Big enough for any machine
+    std::array<uint16_t, 0x10000> lastOpcode{};
+    unsigned long long waitCycles = 0;
+    unsigned long long draws = 0;
+    Clock::duration drawTime{};
+    std::vector<CallNode> nodes;
+    std::map<uint64_t, uint32_t> children; // (parent << 16 | entry) -> node
+    uint32_t current = 0;
+    int depth = 0;
+
+    void enter(uint16_t entry)
+    {
+        // Deeper than the real stack can go means the path is lost anyway
+        if (depth == STACK_SIZE)
+        {
+            return;
+        }
+        const uint64_t key = static_cast<uint64_t>(current) << 16 | entry;
+        auto found = children.find(key);
+        if (found == children.end())
+        {
+            found = children.emplace(key, static_cast<uint32_t>(nodes.size())).first;
+            nodes.push_back(CallNode{current, entry, 0});
+        }
+        current = found->second;
+        ++depth;
+    }
+
+    static std::string opcodeClass(uint16_t opcode);
+    std::string callPath(uint32_t node) const;
+};
+
+// Opcode pattern in the usual notation, e.g. 0x8124 -> "8xy4"
+std::string InstructionProfile::opcodeClass(uint16_t opcode)
+{
+    static const char *const groups[16] = {"0nnn", "1nnn", "2nnn", "3xkk", "4xkk", "5xy?", "6xkk", "7xkk",
+                                           "8xy?", "9xy?", "Annn", "Bnnn", "Cxkk", "Dxyn", "Ex??", "Fx??"};
+    const unsigned group = opcode >> 12;
+    std::string name = groups[group];
+    const char *digits = "0123456789ABCDEF";
+    if (group == 0 && (opcode == 0x00E0 || opcode == 0x00EE))
+    {
+        name = opcode == 0x00E0 ? "00E0" : "00EE";
+    }
+    else if (group == 0x5 || group == 0x8 || group == 0x9)
+    {
+        name[3] = digits[opcode & 0xF];
+    }
+    else if (group == 0xE || group == 0xF)
+    {
+        name[2] = digits[(opcode >> 4) & 0xF];
+        name[3] = digits[opcode & 0xF];
+    }
+    return name;
+}
+
+void InstructionProfile::writeReport(std::ostream &out) const
+{
+    unsigned long long total = 0;
+    std::map<std::string, unsigned long long> classes;
+    for (size_t opcode = 0; opcode < opcodes.size(); ++opcode)
+    {
+        if (opcodes[opcode] != 0)
+        {
+            classes[opcodeClass(static_cast<uint16_t>(opcode))] += opcodes[opcode];
+            total += opcodes[opcode];
+        }
+    }
+    auto share = [total](unsigned long long count) {
+        return total == 0 ? 0.0 : 100.0 * count / total;
+    };
+
+    out << "Executed " << total << " instructions, skipped " << waitCycles << " more in wait loops" << std::endl;
+
+    std::vector<std::pair<std::string, unsigned long long>> byClass(classes.begin(), classes.end());
+    std::stable_sort(byClass.begin(), byClass.end(),
+                     [](const auto &a, const auto &b) { return a.second > b.second; });
+    out << std::endl << "Opcode  Executed      Share" << std::endl;
+    for (const auto &entry : byClass)
+    {
+        out << std::left << std::setw(8) << entry.first << std::right << std::setw(12) << entry.second << std::fixed
+            << std::setprecision(2) << std::setw(10) << share(entry.second) << '%' << std::endl;
+    }
+
+    std::vector<uint16_t> hot;
+    for (size_t address = 0; address < addresses.size(); ++address)
+    {
+        if (addresses[address] != 0)
+        {
+            hot.push_back(static_cast<uint16_t>(address));
+        }
+    }
+    std::stable_sort(hot.begin(), hot.end(), [this](uint16_t a, uint16_t b) { return addresses[a] > addresses[b]; });
+    if (hot.size() > HOT_ADDRESSES)
+    {
+        hot.resize(HOT_ADDRESSES);
+    }
+    out << std::endl << "Address  Opcode  Executed      Share" << std::endl;
+    for (const uint16_t address : hot)
+    {
+        out << "0x" << std::hex << std::uppercase << std::setfill('0') << std::setw(3) << address << "    "
+            << std::setw(4) << lastOpcode[address] << std::dec << std::nouppercase << std::setfill(' ')
+            << std::setw(12) << addresses[address] << std::fixed << std::setprecision(2) << std::setw(10)
+            << share(addresses[address]) << '%' << std::endl;
+    }
+
+    const double drawNs = std::chrono::duration<double, std::nano>(drawTime).count();
+    out << std::endl << "Dxyn: " << draws << " draws, " << std::fixed << std::setprecision(3) << drawNs / 1e6
+        << " ms total, " << std::setprecision(1) << (draws == 0 ? 0.0 : drawNs / draws) << " ns each" << std::endl;
+}
+
+std::string InstructionProfile::callPath(uint32_t node) const
+{
+    std::vector<uint16_t> entries;
+    for (; node != 0; node = nodes[node].parent)
+    {
+        entries.push_back(nodes[node].entry);
+    }
+
+    std::ostringstream path;
+    path << "main";
+    for (auto entry = entries.rbegin(); entry != entries.rend(); ++entry)
+    {
+        path << ";sub_" << std::hex << std::uppercase << std::setfill('0') << std::setw(3) << *entry;
+    }
+    return path.str();
+}
+
+// One "main;sub_2A4;sub_300 <instructions>" line per call path, the
+// collapsed-stack input of flamegraph.pl and compatible viewers
+void InstructionProfile::writeCollapsedStacks(std::ostream &out) const
+{
+    for (uint32_t node = 0; node < nodes.size(); ++node)
+    {
+        if (nodes[node].self != 0)
+        {
+            out << callPath(node) << ' ' << nodes[node].self << '\n';
+        }
+    }
+}
+#endif
+
+// Opcode behaviours that differ between interpreters. ROMs written for
+// one often misbehave on another, so each set is a compile-time policy:
+// the handlers test these with if constexpr and pay nothing per
+// instruction for the behaviour they do not use.
+//
+// The behaviour most CHIP-8 ROMs since the HP48 ports assume, as written
+// up in Cowgod's reference; SUPER-CHIP and Octo build on it.
+struct LegacyQuirks
+{
+    static constexpr const char *NAME = "legacy";
+    static constexpr bool SHIFT_READS_VY = false;        // 8xy6/8xyE shift Vy into Vx, not Vx in place
+    static constexpr bool LOAD_STORE_ADVANCES_I = false; // Fx55/Fx65 leave I at I + x + 1
+    static constexpr bool JUMP_ADDS_VX = false;          // Bxnn jumps to xnn + Vx, not nnn + V0
+    static constexpr bool SPRITES_WRAP = false;          // Dxyn wraps around the edges instead of clipping
+};
+
+// The original COSMAC VIP interpreter
+struct VipQuirks : LegacyQuirks
+{
+    static constexpr const char *NAME = "vip";
+    static constexpr bool SHIFT_READS_VY = true;
+    static constexpr bool LOAD_STORE_ADVANCES_I = true;
+};
+
+struct SuperChipQuirks : LegacyQuirks
+{
+    static constexpr const char *NAME = "schip";
+    static constexpr bool JUMP_ADDS_VX = true;
+};
+
+// As Octo runs XO-CHIP programs
+struct OctoQuirks : LegacyQuirks
+{
+    static constexpr const char *NAME = "octo";
+    static constexpr bool SHIFT_READS_VY = true;
+    static constexpr bool LOAD_STORE_ADVANCES_I = true;
+    static constexpr bool SPRITES_WRAP = true;
+};
+
+// Machine profiles for BasicChip8, resolved at compile time: each
+// instantiation gets arrays of exactly its size and handlers with the
+// other profiles' cases compiled out, so none of them branch on the mode.
+struct ClassicMachine
+{
+    static constexpr uint8_t ID = 0; // Recorded in save states
+    static constexpr const char *NAME = "classic";
+    static constexpr int MEMORY_SIZE = 4096;
+    static constexpr int DISPLAY_WIDTH = 64;
+    static constexpr int DISPLAY_HEIGHT = 32;
+    static constexpr int PLANES = 1;
+    // 00Cn/00FB/00FC scrolling, 00FD exit, 00FE/00FF resolution, Dxy0
+    // 16x16 sprites, Fx30 big digits, Fx75/Fx85 flag registers
+    static constexpr bool SUPER_CHIP = false;
+    // F000 nnnn, 5xy2/5xy3 register ranges, Fn01 planes, 00Dn, F002/Fx3A audio
+    static constexpr bool XO_CHIP = false;
+    using Quirks = LegacyQuirks;
+};
+
+// SUPER-CHIP 1.1: 128x64, with the 64x32 low-resolution mode drawn at
+// double size
+struct SuperChipMachine : ClassicMachine
+{
+    static constexpr uint8_t ID = 1;
+    static constexpr const char *NAME = "schip";
+    static constexpr int DISPLAY_WIDTH = 128;
+    static constexpr int DISPLAY_HEIGHT = 64;
+    static constexpr bool SUPER_CHIP = true;
+    using Quirks = SuperChipQuirks;
+};
+
+// XO-CHIP: SUPER-CHIP plus 64K of memory and two bitplanes
+struct XoChipMachine : SuperChipMachine
+{
+    static constexpr uint8_t ID = 2;
+    static constexpr const char *NAME = "xochip";
+    static constexpr int MEMORY_SIZE = 65536;
+    static constexpr int PLANES = 2;
+    static constexpr bool XO_CHIP = true;
+    using Quirks = OctoQuirks;
+};
+
+// `Base` running with another quirk set, for ROMs that expect it
+template <typename Base, typename QuirkSet>
+struct WithQuirks : Base
+{
+    using Quirks = QuirkSet;
+};
+
+template <typename Machine>
+class BasicChip8
+{
+public:
+    // The machine's dimensions; inside the core these hide the classic
+    // globals of the same name
+    static constexpr int MEMORY_SIZE = Machine::MEMORY_SIZE;
+    static constexpr int DISPLAY_WIDTH = Machine::DISPLAY_WIDTH;
+    static constexpr int DISPLAY_HEIGHT = Machine::DISPLAY_HEIGHT;
+    static constexpr int PAGE_SIZE = MEMORY_SIZE / PAGE_COUNT;
+    static constexpr int PLANES = Machine::PLANES;
+    using Quirks = typename Machine::Quirks;
+    static_assert(DISPLAY_WIDTH == 64 || DISPLAY_WIDTH == 128, "rows are one 64- or 128-bit word");
+    static_assert(DISPLAY_HEIGHT <= 64, "dirtyRows holds one bit per row");
+
+    explicit BasicChip8(uint64_t seed = DEFAULT_SEED) : bootMemory(powerOnMemory())
+    {
+        seedRandom(seed);
+        memory = *bootMemory; // Fontset included
+        V.fill(0);
+        stack.fill(0);
+        display.fill(0);
+        keypad.fill(0);
+        invalidateDecoded(0, MEMORY_SIZE);
+
+        // Reset
+        delayTimer = 0;
+        soundTimer = 0;
+        pc = PROGRAM_START;
+        I = 0;
+        sp = 0;
+    }
+
+    bool loadROM(const std::string &filename);
+    bool loadROM(const RomImage &rom);
+    bool loadProgram(const uint8_t *data, size_t size);
+    void emulateCycle();
+    void run(unsigned long long cycles);
+    void tickTimers();
+    void setKeyState(uint8_t key, bool pressed);
+    void setKeypadMask(uint16_t mask);
+    uint16_t keypadMask() const;
+    void seedRandom(uint64_t seed);
+    void dumpState(std::ostream &out) const;
+    uint64_t stateHash() const;
+    std::vector<uint8_t> saveState() const;
+    bool loadState(const std::vector<uint8_t> &state);
+    void reset();
+    void cloneFrom(const BasicChip8 &source);
+
+    // Loops that cannot change the machine before a key or timer does.
+    // run() skips straight to their outcome instead of spinning.
+    enum class WaitState
+    {
+        None,
+        Key,   // Fx0A with no key held
+        Halt,  // 1nnn jumping to itself, or SUPER-CHIP 00FD
+        Timer, // Fx07 / 3x00 / jump back, polling a running delay timer
+    };
+    WaitState waitState() const;
+    unsigned idleFrames() const;
+
+    // Static control-flow graph of the program in memory, found by
+    // following 1nnn/2nnn/skip edges from PROGRAM_START without running
+    // anything. Bnnn targets depend on V0 (or Vx) and are not followed.
+    struct Analysis
+    {
+        struct BasicBlock
+        {
+            uint16_t start = 0;
+            uint16_t last = 0; // Address of the block's final instruction
+            std::vector<uint16_t> successors;
+        };
+        struct Loop
+        {
+            uint16_t head = 0; // Target of the back edge
+            uint16_t tail = 0; // Branch that closes the loop
+            unsigned instructions = 0;
+            WaitState wait = WaitState::None; // Loops run() skips instead of spinning
+        };
+
+        std::map<uint16_t, BasicBlock> blocks; // By start address
+        std::bitset<MEMORY_SIZE> code;         // Bytes of reachable instructions
+        std::vector<uint16_t> subroutines;     // 2nnn targets, ascending
+        std::vector<uint16_t> indirectJumps;   // Bnnn instructions, ascending
+        std::vector<Loop> loops;               // By head
+        size_t programSize = 0;
+
+        void write(std::ostream &out) const;
+    };
+    Analysis analyze(size_t programSize) const;
+
+#ifdef CHIP8_PROFILE
+    // Records everything this core executes into `target` (null detaches)
+    void setProfile(InstructionProfile *target)
+    {
+        profile = target;
+    }
+#endif
+
+    // One word per row, leftmost pixel in the most significant bit; plane
+    // p's rows start at p * DISPLAY_HEIGHT
+    using Row = std::conditional_t<(DISPLAY_WIDTH > 64), unsigned __int128, uint64_t>;
+    using Framebuffer = std::array<Row, DISPLAY_HEIGHT * PLANES>;
+    using RowMask = std::conditional_t<(DISPLAY_HEIGHT > 32), uint64_t, uint32_t>; // Bit y = row y
+
+    // 64-bit word `word` of a row, leftmost first
+    static uint64_t rowWord(Row row, int word)
+    {
+        if constexpr (DISPLAY_WIDTH > 64)
+        {
+            return static_cast<uint64_t>(row >> (64 * (1 - word)));
+        }
+        else
+        {
+            (void)word;
+            return row;
+        }
+    }
+    static constexpr int ROW_WORDS = DISPLAY_WIDTH / 64;
+
+    static Row rotateRight(Row row, unsigned bits)
+    {
+        return bits == 0 ? row : (row >> bits) | (row << (DISPLAY_WIDTH - bits));
+    }
+
+    bool shouldDraw() const
+    {
+        return dirtyRows != 0;
+    }
+
+    const Framebuffer &framebuffer() const
+    {
+        return display;
+    }
+
+    // The frontend has taken the current picture
+    void markDrawn()
+    {
+        dirtyRows = 0;
+    }
+
+    bool soundActive() const
+    {
+        return soundTimer > 0;
+    }
+
+private:
+    template <typename>
+    friend class BasicSnapshotRing;
+    template <size_t Lanes>
+    friend class Chip8Lanes;
+
+    // Components
+    std::array<uint8_t, MEMORY_SIZE> memory{};
+    std::array<uint8_t, REGISTER_COUNT> V{};
+    uint16_t I = 0;
+    uint16_t pc = PROGRAM_START;
+    std::array<uint16_t, STACK_SIZE> stack{};
+    uint16_t sp = 0; // Stack pointer
+
+    Framebuffer display{};
+    std::array<uint8_t, KEYPAD_SIZE> keypad{};
+
+    uint8_t delayTimer = 0;
+    uint8_t soundTimer = 0;
+
+    // Bit y: row y may have changed since the frontend last took a frame
+    RowMask dirtyRows = 0;
+    static constexpr RowMask ALL_ROWS =
+        DISPLAY_HEIGHT == 8 * sizeof(RowMask) ? ~RowMask(0) : (RowMask(1) << DISPLAY_HEIGHT) - 1;
+
+    // SUPER-CHIP / XO-CHIP state beyond the classic registers; unused by
+    // the classic machine
+    struct ModeState
+    {
+        uint8_t hires = 0;  // 00FF; low resolution draws every pixel 2x2
+        uint8_t planes = 1; // Fn01: bitplanes that drawing, clearing and scrolling touch
+        uint8_t pitch = 64; // Fx3A
+        std::array<uint8_t, 16> flags{};   // Fx75/Fx85 flag registers
+        std::array<uint8_t, 16> pattern{}; // F002 audio pattern
+    };
+    ModeState mode{};
+    static constexpr unsigned FLAG_COUNT = Machine::XO_CHIP ? 16 : 8;
+
+#ifdef CHIP8_PROFILE
+    InstructionProfile *profile = nullptr;
+
+    void profileStep()
+    {
+        if (profile)
+        {
+            profile->record(pc & (MEMORY_SIZE - 1), opcodeAt(pc));
+        }
+    }
+#endif
+
+    // xorshift64* state for Cxkk; per instance so cores never share a
+    // generator and a given seed always replays the same bytes
+    uint64_t rngState = 0;
+    uint8_t nextRandom();
+
+    // Pages of memory written since the bit was last cleared by a snapshot
+    uint16_t dirtyPages = 0;
+    static_assert(PAGE_COUNT <= 16, "dirtyPages holds one bit per page");
+
+    // Memory right after the last loadProgram (or power-on), shared by
+    // copies of this instance. reset() and clones of a machine with the
+    // same boot image only touch `changedPages`, the pages that may differ.
+    using MemoryImage = std::array<uint8_t, MEMORY_SIZE>;
+    std::shared_ptr<const MemoryImage> bootMemory;
+    uint16_t changedPages = 0;
+    uint64_t bootRngState = 0; // rngState as last seeded
+    static std::shared_ptr<const MemoryImage> powerOnMemory();
+    void restorePages(const MemoryImage &source, uint16_t pages);
+
+    // Everything a snapshot restores except memory. The keypad is host
+    // input, not machine state, so it is deliberately left out.
+    struct CoreState
+    {
+        std::array<uint8_t, REGISTER_COUNT> V;
+        std::array<uint16_t, STACK_SIZE> stack;
+        Framebuffer display;
+        uint16_t I;
+        uint16_t pc;
+        uint16_t sp;
+        uint8_t delayTimer;
+        uint8_t soundTimer;
+        RowMask dirtyRows;
+        uint64_t rngState;
+        ModeState mode;
+    };
+
+    CoreState coreState() const;
+    void setCoreState(const CoreState &state);
+
+    static constexpr size_t MODE_STATE_SIZE = Machine::SUPER_CHIP ? 2 + FLAG_COUNT + (Machine::XO_CHIP ? 16 + 1 : 0) : 0;
+    static constexpr size_t SAVE_STATE_SIZE = 4 + 1 + 1 + MEMORY_SIZE + REGISTER_COUNT + 2 * STACK_SIZE +
+                                              8 * ROW_WORDS * DISPLAY_HEIGHT * PLANES + 2 + 2 + 2 + 1 + 1 + 1 + 8 +
+                                              MODE_STATE_SIZE;
+
+    static constexpr std::array<uint8_t, FONTSET_SIZE> fontset = {{
+        0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
+        0x20, 0x60, 0x20, 0x20, 0x70, // 1
+        0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
+        0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
+        0x90, 0x90, 0xF0, 0x10, 0x10, // 4
+        0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
+        0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
+        0xF0, 0x10, 0x20, 0x40, 0x40, // 7
+        0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
+        0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
+        0xF0, 0x90, 0xF0, 0x90, 0x90, // A
+        0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
+        0xF0, 0x80, 0x80, 0x80, 0xF0, // C
+        0xE0, 0x90, 0x90, 0x90, 0xE0, // D
+        0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
+        0xF0, 0x80, 0xF0, 0x80, 0x80  // F
+    }};
+
+    static constexpr std::array<uint8_t, BIG_FONTSET_SIZE> bigFontset = {{
+        0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, // 0
+        0x18, 0x78, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0xFF, 0xFF, // 1
+        0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // 2
+        0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 3
+        0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0x03, 0x03, // 4
+        0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 5
+        0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 6
+        0xFF, 0xFF, 0x03, 0x03, 0x06, 0x0C, 0x18, 0x18, 0x18, 0x18, // 7
+        0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 8
+        0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 9
+        0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, // A
+        0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, // B
+        0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C, // C
+        0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+        0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // E
+        0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0  // F
+    }};
+
+    // Decoded form of an opcode: the function implementing it plus every
+    // operand field extracted up front, so handlers never re-mask opcode.
+    struct Instruction;
+    using Handler = void (*)(BasicChip8 &, const Instruction &);
+    struct Instruction
+    {
+        Handler handler;
+        uint16_t opcode;
+        uint16_t nnn;
+        uint8_t x;
+        uint8_t y;
+        uint8_t n;
+        uint8_t kk;
+    };
+
+    // Decoded instruction for every address. Entries start out (and return
+    // to, when memory under them is written) pointing at opDecode, which
+    // decodes the real opcode in place the first time it executes.
+    std::array<Instruction, MEMORY_SIZE> decodeCache;
+
+#ifndef CHIP8_NO_BLOCKS
+    // Threaded code: a block is the straight-line run of decoded
+    // instructions starting at an address, up to and including the first
+    // one that may change control flow or write memory. Executing a block is
+    // a loop of indirect calls with no per-instruction lookup.
+    struct Block
+    {
+        uint32_t first = 0;  // Index into blockPool
+        uint16_t length = 0; // 0 = not compiled
+    };
+    std::array<Block, MEMORY_SIZE> blocks{};
+    std::vector<Instruction> blockPool;
+    std::bitset<MEMORY_SIZE> blockBytes; // Memory covered by any compiled block
+
+    const Block &compileBlock(uint16_t start);
+    void flushBlocks();
+    static bool endsBlock(Handler handler);
+#endif
+
+    uint16_t fetchOpcode();
+    uint16_t opcodeAt(uint16_t address) const;
+    bool delayLoopHead(uint16_t &head) const;
+    bool isDelayPoll(uint16_t start) const;
+    void skipWait(WaitState state, unsigned long long cycles);
+    void invalidateDecoded(uint16_t address, unsigned length);
+    void markWritten(uint16_t address, unsigned length);
+    static uint16_t skipLength(const BasicChip8 &c);
+    void drawSprite(uint8_t x, uint8_t y, uint8_t n);
+    void scroll(int down, int right);
+    static Instruction decode(uint16_t opcode);
+    static Handler lookupHandler(uint16_t opcode);
+    static std::array<Handler, 0x10000> buildDispatchTable();
+
+    static void op00E0(BasicChip8 &c, const Instruction &ins);
+    static void op00EE(BasicChip8 &c, const Instruction &ins);
+    static void op1nnn(BasicChip8 &c, const Instruction &ins);
+    static void op2nnn(BasicChip8 &c, const Instruction &ins);
+    static void op3xkk(BasicChip8 &c, const Instruction &ins);
+    static void op4xkk(BasicChip8 &c, const Instruction &ins);
+    static void op5xy0(BasicChip8 &c, const Instruction &ins);
+    static void op6xkk(BasicChip8 &c, const Instruction &ins);
+    static void op7xkk(BasicChip8 &c, const Instruction &ins);
+    static void op8xy0(BasicChip8 &c, const Instruction &ins);
+    static void op8xy1(BasicChip8 &c, const Instruction &ins);
+    static void op8xy2(BasicChip8 &c, const Instruction &ins);
+    static void op8xy3(BasicChip8 &c, const Instruction &ins);
+    static void op8xy4(BasicChip8 &c, const Instruction &ins);
+    static void op8xy5(BasicChip8 &c, const Instruction &ins);
+    static void op8xy6(BasicChip8 &c, const Instruction &ins);
+    static void op8xy7(BasicChip8 &c, const Instruction &ins);
+    static void op8xyE(BasicChip8 &c, const Instruction &ins);
+    static void op9xy0(BasicChip8 &c, const Instruction &ins);
+    static void opAnnn(BasicChip8 &c, const Instruction &ins);
+    static void opBnnn(BasicChip8 &c, const Instruction &ins);
+    static void opCxkk(BasicChip8 &c, const Instruction &ins);
+    static void opDxyn(BasicChip8 &c, const Instruction &ins);
+    static void opEx9E(BasicChip8 &c, const Instruction &ins);
+    static void opExA1(BasicChip8 &c, const Instruction &ins);
+    static void opFx07(BasicChip8 &c, const Instruction &ins);
+    static void opFx0A(BasicChip8 &c, const Instruction &ins);
+    static void opFx15(BasicChip8 &c, const Instruction &ins);
+    static void opFx18(BasicChip8 &c, const Instruction &ins);
+    static void opFx1E(BasicChip8 &c, const Instruction &ins);
+    static void opFx29(BasicChip8 &c, const Instruction &ins);
+    static void opFx33(BasicChip8 &c, const Instruction &ins);
+    static void opFx55(BasicChip8 &c, const Instruction &ins);
+    static void opFx65(BasicChip8 &c, const Instruction &ins);
+    static void op00Cn(BasicChip8 &c, const Instruction &ins);
+    static void op00Dn(BasicChip8 &c, const Instruction &ins);
+    static void op00FB(BasicChip8 &c, const Instruction &ins);
+    static void op00FC(BasicChip8 &c, const Instruction &ins);
+    static void op00FD(BasicChip8 &c, const Instruction &ins);
+    static void op00FE(BasicChip8 &c, const Instruction &ins);
+    static void op00FF(BasicChip8 &c, const Instruction &ins);
+    static void op5xy2(BasicChip8 &c, const Instruction &ins);
+    static void op5xy3(BasicChip8 &c, const Instruction &ins);
+    static void opF000(BasicChip8 &c, const Instruction &ins);
+    static void opFn01(BasicChip8 &c, const Instruction &ins);
+    static void opF002(BasicChip8 &c, const Instruction &ins);
+    static void opFx30(BasicChip8 &c, const Instruction &ins);
+    static void opFx3A(BasicChip8 &c, const Instruction &ins);
+    static void opFx75(BasicChip8 &c, const Instruction &ins);
+    static void opFx85(BasicChip8 &c, const Instruction &ins);
+    static void opUnknown(BasicChip8 &c, const Instruction &ins);
+    static void opDecode(BasicChip8 &c, const Instruction &ins);
+};
+
+using Chip8 = BasicChip8<ClassicMachine>;
+
+template <typename Machine>
+bool BasicChip8<Machine>::loadROM(const std::string &filename)
+{
+    const std::shared_ptr<const RomImage> rom = RomImage::open(filename);
+    return rom && loadROM(*rom);
+}
+
+template <typename Machine>
+bool BasicChip8<Machine>::loadROM(const RomImage &rom)
+{
+    return loadProgram(rom.data(), rom.size());
+}
+
+template <typename Machine>
+bool BasicChip8<Machine>::loadProgram(const uint8_t *data, size_t size)
+{
+    if (size > MEMORY_SIZE - PROGRAM_START)
+    {
+        std::cerr << "ROM is " << size << " bytes; at most " << MEMORY_SIZE - PROGRAM_START << " fit" << std::endl;
+        return false;
+    }
+
+    if (size > 0)
+    {
+        std::memcpy(&memory[PROGRAM_START], data, size);
+    }
+
+    for (size_t address = PROGRAM_START; address < PROGRAM_START + size; ++address)
+    {
+        decodeCache[address] = decode((memory[address] << 8) | memory[(address + 1) & (MEMORY_SIZE - 1)]);
+    }
+    invalidateDecoded(PROGRAM_START, 0); // The entry straddling the ROM start
+
+#ifndef CHIP8_NO_BLOCKS
+    // Compile every block the program can reach up front, so the first
+    // frames run at full speed instead of compiling as they go
+    for (const auto &entry : analyze(size).blocks)
+    {
+        if (blocks[entry.first].length == 0)
+        {
+            compileBlock(entry.first);
+        }
+    }
+#endif
+    dirtyPages = static_cast<uint16_t>((1u << PAGE_COUNT) - 1);
+    bootMemory = std::make_shared<const MemoryImage>(memory);
+    changedPages = 0;
+
+    return true;
+}
+
+template <typename Machine>
+uint16_t BasicChip8<Machine>::fetchOpcode()
+{
+    return opcodeAt(pc);
+}
+
+template <typename Machine>
+uint16_t BasicChip8<Machine>::opcodeAt(uint16_t address) const
+{
+    return (memory[address & (MEMORY_SIZE - 1)] << 8) | memory[(address + 1) & (MEMORY_SIZE - 1)];
+}
+
+// Drops cached decodes for [address, address + length) and for the entry
+// at address - 1, whose second byte is address.
+template <typename Machine>
+void BasicChip8<Machine>::invalidateDecoded(uint16_t address, unsigned length)
+{
+    const Instruction undecoded = {&opDecode, 0, 0, 0, 0, 0, 0};
+    bool coversBlock = false;
+    for (unsigned i = 0; i <= length; ++i)
+    {
+        const unsigned entry = (address - 1 + i) & (MEMORY_SIZE - 1);
+        decodeCache[entry] = undecoded;
+#ifndef CHIP8_NO_BLOCKS
+        coversBlock |= blockBytes[entry];
+#endif
+    }
+
+#ifndef CHIP8_NO_BLOCKS
+    // Writes into compiled code are rare enough that dropping every block
+    // is cheaper than tracking which blocks overlap the write.
+    if (coversBlock)
+    {
+        flushBlocks();
+    }
+#else
+    (void)coversBlock;
+#endif
+}
+
+// Called for every store to memory by an instruction
+template <typename Machine>
+void BasicChip8<Machine>::markWritten(uint16_t address, unsigned length)
+{
+    invalidateDecoded(address, length);
+    for (unsigned i = 0; i < length; ++i)
+    {
+        const uint16_t page = static_cast<uint16_t>(1u << (((address + i) & (MEMORY_SIZE - 1)) / PAGE_SIZE));
+        dirtyPages |= page;
+        changedPages |= page;
+    }
+}
+
+template <typename Machine>
+std::shared_ptr<const typename BasicChip8<Machine>::MemoryImage> BasicChip8<Machine>::powerOnMemory()
+{
+    static const std::shared_ptr<const MemoryImage> image = [] {
+        std::shared_ptr<MemoryImage> memory = std::make_shared<MemoryImage>();
+        memory->fill(0);
+        std::copy(fontset.begin(), fontset.end(), memory->begin() + FONT_START);
+        if constexpr (Machine::SUPER_CHIP)
+        {
+            std::copy(bigFontset.begin(), bigFontset.end(), memory->begin() + BIG_FONT_START);
+        }
+        return memory;
+    }();
+    return image;
+}
+
+// Copies the given pages from `source`, invalidating only the decoded
+// instructions (and blocks) over bytes that actually differ, so code
+// sharing a page with data keeps its compiled form.
+template <typename Machine>
+void BasicChip8<Machine>::restorePages(const MemoryImage &source, uint16_t pages)
+{
+    for (int page = 0; page < PAGE_COUNT; ++page)
+    {
+        if (!(pages & (1u << page)))
+        {
+            continue;
+        }
+
+        const int offset = page * PAGE_SIZE;
+        int first = offset;
+        int last = offset + PAGE_SIZE - 1;
+        while (first <= last && memory[first] == source[first])
+        {
+            ++first;
+        }
+        while (last >= first && memory[last] == source[last])
+        {
+            --last;
+        }
+        if (first <= last)
+        {
+            std::memcpy(&memory[first], &source[first], last - first + 1);
+            invalidateDecoded(static_cast<uint16_t>(first), last - first + 1);
+            dirtyPages |= 1u << page;
+        }
+    }
+}
+
+// Back to the state right after the last loadProgram (or construction):
+// boot memory, cleared registers, display and keypad, and the generator
+// at its last seed. Cached decodes and blocks over unchanged code survive.
+template <typename Machine>
+void BasicChip8<Machine>::reset()
+{
+    restorePages(*bootMemory, changedPages);
+    changedPages = 0;
+
+    V.fill(0);
+    stack.fill(0);
+    display.fill(0);
+    keypad.fill(0);
+    I = 0;
+    pc = PROGRAM_START;
+    sp = 0;
+    delayTimer = 0;
+    soundTimer = 0;
+    dirtyRows = ALL_ROWS;
+    rngState = bootRngState;
+    mode = ModeState{};
+#ifdef CHIP8_PROFILE
+    if (profile)
+    {
+        profile->unwind();
+    }
+#endif
+}
+
+// Makes this machine equal to `source`, keypad included. Clones of one
+// template only copy the pages either side has written since boot;
+// otherwise memory and decodes are replaced whole.
+template <typename Machine>
+void BasicChip8<Machine>::cloneFrom(const BasicChip8 &source)
+{
+    if (&source == this)
+    {
+        return;
+    }
+
+    if (bootMemory == source.bootMemory)
+    {
+        restorePages(source.memory, changedPages | source.changedPages);
+    }
+    else
+    {
+        memory = source.memory;
+        invalidateDecoded(0, MEMORY_SIZE);
+        dirtyPages = static_cast<uint16_t>((1u << PAGE_COUNT) - 1);
+        bootMemory = source.bootMemory;
+    }
+    changedPages = source.changedPages;
+
+    setCoreState(source.coreState());
+    dirtyRows = ALL_ROWS;
+    keypad = source.keypad;
+    bootRngState = source.bootRngState;
+}
+
+#ifndef CHIP8_NO_BLOCKS
+template <typename Machine>
+bool BasicChip8<Machine>::endsBlock(Handler handler)
+{
+    return handler == &op00EE || handler == &op1nnn || handler == &op2nnn ||
+           handler == &op3xkk || handler == &op4xkk || handler == &op5xy0 || handler == &op9xy0 ||
+           handler == &opBnnn || handler == &opEx9E || handler == &opExA1 ||
+           handler == &opFx0A || handler == &opFx33 || handler == &opFx55 || handler == &opUnknown ||
+           // 00FD loops on itself, 5xy2 writes memory and F000's operand is not an instruction
+           (Machine::SUPER_CHIP && handler == &op00FD) ||
+           (Machine::XO_CHIP && (handler == &op5xy2 || handler == &opF000));
+}
+
+template <typename Machine>
+const typename BasicChip8<Machine>::Block &BasicChip8<Machine>::compileBlock(uint16_t start)
+{
+    if (blockPool.size() + MAX_BLOCK_LENGTH > BLOCK_POOL_LIMIT)
+    {
+        flushBlocks();
+    }
+
+    Block &block = blocks[start];
+    block.first = static_cast<uint32_t>(blockPool.size());
+
+    uint16_t address = start;
+    do
+    {
+        const uint16_t opcode = (memory[address] << 8) | memory[(address + 1) & (MEMORY_SIZE - 1)];
+        blockPool.push_back(decode(opcode));
+        blockBytes[address] = true;
+        blockBytes[(address + 1) & (MEMORY_SIZE - 1)] = true;
+        address = (address + 2) & (MEMORY_SIZE - 1);
+    } while (!endsBlock(blockPool.back().handler) && blockPool.size() - block.first < MAX_BLOCK_LENGTH);
+
+    block.length = static_cast<uint16_t>(blockPool.size() - block.first);
+    return block;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::flushBlocks()
+{
+    blocks.fill(Block{});
+    blockPool.clear();
+    blockBytes.reset();
+}
+#endif
+
+template <typename Machine>
+typename BasicChip8<Machine>::Instruction BasicChip8<Machine>::decode(uint16_t opcode)
+{
+    Instruction ins;
+#ifdef CHIP8_DISPATCH_SWITCH
+    ins.handler = lookupHandler(opcode);
+#else
+    // Built on first use, so only the machines a run instantiates and
+    // actually executes pay for a table
+    static const std::array<Handler, 0x10000> dispatchTable = buildDispatchTable();
+    ins.handler = dispatchTable[opcode];
+#endif
+    ins.opcode = opcode;
+    ins.nnn = opcode & 0x0FFF;
+    ins.x = (opcode & 0x0F00) >> 8;
+    ins.y = (opcode & 0x00F0) >> 4;
+    ins.n = opcode & 0x000F;
+    ins.kk = opcode & 0x00FF;
+    return ins;
+}
+
+// Maps an opcode to the function implementing it. The default build runs
+// this once per opcode to fill dispatchTable; -DCHIP8_DISPATCH_SWITCH calls
+// it on every instruction instead, skipping the decode cache and blocks.
+template <typename Machine>
+typename BasicChip8<Machine>::Handler BasicChip8<Machine>::lookupHandler(uint16_t opcode)
+{
+    switch (opcode & 0xF000)
+    {
+    case 0x0000:
+        if (opcode == 0x00E0)
+        {
+            return &op00E0;
+        }
+        if (opcode == 0x00EE)
+        {
+            return &op00EE;
+        }
+        if constexpr (Machine::SUPER_CHIP)
+        {
+            switch (opcode & 0xFFF0)
+            {
+            case 0x00C0:
+                return &op00Cn;
+            case 0x00D0:
+                if constexpr (Machine::XO_CHIP)
+                {
+                    return &op00Dn;
+                }
+                break;
+            }
+            switch (opcode)
+            {
+            case 0x00FB:
+                return &op00FB;
+            case 0x00FC:
+                return &op00FC;
+            case 0x00FD:
+                return &op00FD;
+            case 0x00FE:
+                return &op00FE;
+            case 0x00FF:
+                return &op00FF;
+            }
+        }
+        return &opUnknown;
+    case 0x1000:
+        return &op1nnn;
+    case 0x2000:
+        return &op2nnn;
+    case 0x3000:
+        return &op3xkk;
+    case 0x4000:
+        return &op4xkk;
+    case 0x5000:
+        if constexpr (Machine::XO_CHIP)
+        {
+            if ((opcode & 0x000F) == 0x2)
+            {
+                return &op5xy2;
+            }
+            if ((opcode & 0x000F) == 0x3)
+            {
+                return &op5xy3;
+            }
+        }
+        return &op5xy0;
+    case 0x6000:
+        return &op6xkk;
+    case 0x7000:
+        return &op7xkk;
+    case 0x8000:
+        switch (opcode & 0x000F)
+        {
+        case 0x0:
+            return &op8xy0;
+        case 0x1:
+            return &op8xy1;
+        case 0x2:
+            return &op8xy2;
+        case 0x3:
+            return &op8xy3;
+        case 0x4:
+            return &op8xy4;
+        case 0x5:
+            return &op8xy5;
+        case 0x6:
+            return &op8xy6;
+        case 0x7:
+            return &op8xy7;
+        case 0xE:
+            return &op8xyE;
+        }
+        return &opUnknown;
+    case 0x9000:
+        return &op9xy0;
+    case 0xA000:
+        return &opAnnn;
+    case 0xB000:
+        return &opBnnn;
+    case 0xC000:
+        return &opCxkk;
+    case 0xD000:
+        return &opDxyn;
+    case 0xE000:
+        switch (opcode & 0x00FF)
+        {
+        case 0x9E:
+            return &opEx9E;
+        case 0xA1:
+            return &opExA1;
+        }
+        return &opUnknown;
+    case 0xF000:
+        switch (opcode & 0x00FF)
+        {
+        case 0x07:
+            return &opFx07;
+        case 0x0A:
+            return &opFx0A;
+        case 0x15:
+            return &opFx15;
+        case 0x18:
+            return &opFx18;
+        case 0x1E:
+            return &opFx1E;
+        case 0x29:
+            return &opFx29;
+        case 0x33:
+            return &opFx33;
+        case 0x55:
+            return &opFx55;
+        case 0x65:
+            return &opFx65;
+        }
+        if constexpr (Machine::SUPER_CHIP)
+        {
+            switch (opcode & 0x00FF)
+            {
+            case 0x30:
+                return &opFx30;
+            case 0x75:
+                return &opFx75;
+            case 0x85:
+                return &opFx85;
+            }
+        }
+        if constexpr (Machine::XO_CHIP)
+        {
+            if (opcode == 0xF000)
+            {
+                return &opF000;
+            }
+            if (opcode == 0xF002)
+            {
+                return &opF002;
+            }
+            switch (opcode & 0x00FF)
+            {
+            case 0x01:
+                return &opFn01;
+            case 0x3A:
+                return &opFx3A;
+            }
+        }
+        return &opUnknown;
+    }
+    return &opUnknown;
+}
+
+template <typename Machine>
+std::array<typename BasicChip8<Machine>::Handler, 0x10000> BasicChip8<Machine>::buildDispatchTable()
+{
+    std::array<Handler, 0x10000> table{};
+    for (size_t opcode = 0; opcode < table.size(); ++opcode)
+    {
+        table[opcode] = lookupHandler(static_cast<uint16_t>(opcode));
+    }
+    return table;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::op00E0(BasicChip8 &c, const Instruction &) // Clear Display
+{
+    if constexpr (PLANES > 1)
+    {
+        for (int plane = 0; plane < PLANES; ++plane)
+        {
+            if (c.mode.planes & (1u << plane))
+            {
+                std::fill_n(c.display.begin() + plane * DISPLAY_HEIGHT, DISPLAY_HEIGHT, Row(0));
+            }
+        }
+    }
+    else
+    {
+        c.display.fill(0);
+    }
+    c.dirtyRows = ALL_ROWS;
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::op00EE(BasicChip8 &c, const Instruction &) // Return from a subroutine, like return to a parent functions of sorts
+{
+    // The stack is circular: a ROM that overflows or underflows it reads
+    // back garbage instead of leaving the array
+    --c.sp;
+    c.pc = c.stack[c.sp & (STACK_SIZE - 1)];
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::op1nnn(BasicChip8 &c, const Instruction &ins) // Jump to nnn in 1nnn
+{
+    c.pc = ins.nnn;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::op2nnn(BasicChip8 &c, const Instruction &ins) // 2nnn, current pc is put on top of stack and pc is set to nnn
+{
+    c.stack[c.sp & (STACK_SIZE - 1)] = c.pc;
+    ++c.sp;
+    c.pc = ins.nnn;
+}
+
+// Bytes a taken skip moves pc by: XO-CHIP skips F000 and its operand whole
+template <typename Machine>
+uint16_t BasicChip8<Machine>::skipLength(const BasicChip8 &c)
+{
+    if constexpr (Machine::XO_CHIP)
+    {
+        return c.opcodeAt(c.pc + 2) == 0xF000 ? 6 : 4;
+    }
+    else
+    {
+        (void)c;
+        return 4;
+    }
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::op3xkk(BasicChip8 &c, const Instruction &ins) // 3xkk - if Vx=kk, then skip instruction
+{
+    c.pc += (c.V[ins.x] == ins.kk) ? skipLength(c) : 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::op4xkk(BasicChip8 &c, const Instruction &ins) // 4xkk - skip instruction if Vx!=kk
+{
+    c.pc += (c.V[ins.x] != ins.kk) ? skipLength(c) : 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::op5xy0(BasicChip8 &c, const Instruction &ins) // 5xy0 - skip if Vx=Vy
+{
+    c.pc += (c.V[ins.x] == c.V[ins.y]) ? skipLength(c) : 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::op6xkk(BasicChip8 &c, const Instruction &ins) // 6xkk - set Vx to kk
+{
+    c.V[ins.x] = ins.kk;
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::op7xkk(BasicChip8 &c, const Instruction &ins) // 7xkk - add kk to Vx
+{
+    c.V[ins.x] += ins.kk;
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::op8xy0(BasicChip8 &c, const Instruction &ins) // 8xy0 - Vx = Vy
+{
+    c.V[ins.x] = c.V[ins.y];
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::op8xy1(BasicChip8 &c, const Instruction &ins) // 8xy1 - OR Vx ,Vy
+{
+    c.V[ins.x] |= c.V[ins.y];
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::op8xy2(BasicChip8 &c, const Instruction &ins) // 8xy2 - AND Vx ,Vy
+{
+    c.V[ins.x] &= c.V[ins.y];
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::op8xy3(BasicChip8 &c, const Instruction &ins) // 8xy3 - XOR Vx, Vy
+{
+    c.V[ins.x] ^= c.V[ins.y];
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::op8xy4(BasicChip8 &c, const Instruction &ins) // 8xy4 - ADD Vx, Vy
+{
+    uint16_t sum = c.V[ins.x] + c.V[ins.y];
+    c.V[0xF] = (sum > 0xFF) ? 1 : 0;
+    c.V[ins.x] = sum & 0xFF;
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::op8xy5(BasicChip8 &c, const Instruction &ins) // 8xy5 - SUB Vx - Vy
+{
+    c.V[0xF] = (c.V[ins.x] > c.V[ins.y]) ? 1 : 0;
+    c.V[ins.x] -= c.V[ins.y];
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::op8xy6(BasicChip8 &c, const Instruction &ins) // 8xy6 - Shift right Vx
+{
+    const uint8_t source = Quirks::SHIFT_READS_VY ? c.V[ins.y] : c.V[ins.x];
+    c.V[0xF] = source & 0x1;
+    c.V[ins.x] = source >> 1;
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::op8xy7(BasicChip8 &c, const Instruction &ins) // 8xy7 - SUBN Vy - Vx
+{
+    c.V[0xF] = (c.V[ins.y] > c.V[ins.x]) ? 1 : 0;
+    c.V[ins.x] = c.V[ins.y] - c.V[ins.x];
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::op8xyE(BasicChip8 &c, const Instruction &ins) // 8xyE - shift left Vx
+{
+    const uint8_t source = Quirks::SHIFT_READS_VY ? c.V[ins.y] : c.V[ins.x];
+    c.V[0xF] = (source & 0x80) >> 7;
+    c.V[ins.x] = static_cast<uint8_t>(source << 1);
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::op9xy0(BasicChip8 &c, const Instruction &ins) // 9xy0 - skip if Vx != Vy
+{
+    c.pc += (c.V[ins.x] != c.V[ins.y]) ? skipLength(c) : 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::opAnnn(BasicChip8 &c, const Instruction &ins) // Annn - set I to nnn
+{
+    c.I = ins.nnn;
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::opBnnn(BasicChip8 &c, const Instruction &ins) // Bnn - Jump to nnn + v[0]
+{
+    c.pc = ins.nnn + c.V[Quirks::JUMP_ADDS_VX ? ins.x : 0];
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::opCxkk(BasicChip8 &c, const Instruction &ins) // Cxkk - Vx = rand byte under 255 AND kk
+{
+    c.V[ins.x] = c.nextRandom() & ins.kk;
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::opDxyn(BasicChip8 &c, const Instruction &ins) // Dxyn
+// Refer Technical reference
+{
+#ifdef CHIP8_PROFILE
+    const InstructionProfile::Clock::time_point started = InstructionProfile::Clock::now();
+#endif
+    if constexpr (Machine::SUPER_CHIP)
+    {
+        c.drawSprite(c.V[ins.x], c.V[ins.y], ins.n);
+    }
+    else
+    {
+        const unsigned px = c.V[ins.x] % DISPLAY_WIDTH;
+        const unsigned py = c.V[ins.y] % DISPLAY_HEIGHT;
+        uint64_t collision = 0;
+
+        // Each sprite row is placed at the top of a word and shifted to px;
+        // bits pushed past the right edge fall off, which clips the sprite,
+        // or are rotated back in on the left when sprites wrap.
+        for (unsigned row = 0; row < ins.n && (Quirks::SPRITES_WRAP || py + row < DISPLAY_HEIGHT); ++row)
+        {
+            const unsigned line = Quirks::SPRITES_WRAP ? (py + row) % DISPLAY_HEIGHT : py + row;
+            const uint64_t sprite = static_cast<uint64_t>(c.memory[(c.I + row) & (MEMORY_SIZE - 1)]) << 56;
+            const uint64_t bits = Quirks::SPRITES_WRAP ? rotateRight(sprite, px) : sprite >> px;
+            collision |= c.display[line] & bits;
+            c.display[line] ^= bits;
+            c.dirtyRows |= static_cast<uint32_t>(bits != 0) << line;
+        }
+
+        c.V[0xF] = collision != 0;
+    }
+    c.pc += 2;
+
+#ifdef CHIP8_PROFILE
+    if (c.profile)
+    {
+        c.profile->drew(InstructionProfile::Clock::now() - started);
+    }
+#endif
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::opEx9E(BasicChip8 &c, const Instruction &ins) // Skip next instruction if key value with Vx is pressed
+{
+    c.pc += c.keypad[c.V[ins.x] & 0xF] ? skipLength(c) : 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::opExA1(BasicChip8 &c, const Instruction &ins) // Skip next instruction if Key value with Vx is not pressed
+{
+    c.pc += !c.keypad[c.V[ins.x] & 0xF] ? skipLength(c) : 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::opFx07(BasicChip8 &c, const Instruction &ins) // Fx07 - Vx = delayTimer
+{
+    c.V[ins.x] = c.delayTimer;
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::opFx0A(BasicChip8 &c, const Instruction &ins) // Store value of key in Vx after waiting for key press
+{
+    for (int i = 0; i < KEYPAD_SIZE; ++i)
+    {
+        if (c.keypad[i])
+        {
+            c.V[ins.x] = i;
+            c.pc += 2;
+            return;
+        }
+    }
+    // No key yet: leave pc alone so the instruction runs again
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::opFx15(BasicChip8 &c, const Instruction &ins) // Fx15 - set delayTimer to Vx
+{
+    c.delayTimer = c.V[ins.x];
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::opFx18(BasicChip8 &c, const Instruction &ins) // Fx18 - set sounTimer to Vx
+{
+    c.soundTimer = c.V[ins.x];
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::opFx1E(BasicChip8 &c, const Instruction &ins) // Fx1E - I = I + Vx, location of sprite for Vx
+{
+    c.I += c.V[ins.x];
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::opFx29(BasicChip8 &c, const Instruction &ins) // Fx29 - Set location of sprite for digit Vx
+{
+    c.I = FONT_START + (c.V[ins.x] & 0xF) * 5;
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::opFx33(BasicChip8 &c, const Instruction &ins) // Store BCD of Vx in I, I+1, I+2
+{
+    uint8_t value = c.V[ins.x];
+    c.memory[c.I & (MEMORY_SIZE - 1)] = value / 100;
+    c.memory[(c.I + 1) & (MEMORY_SIZE - 1)] = (value / 10) % 10;
+    c.memory[(c.I + 2) & (MEMORY_SIZE - 1)] = value % 10;
+    c.markWritten(c.I, 3);
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::opFx55(BasicChip8 &c, const Instruction &ins) // Fx55 - Store V0 to Vx starting at location I
+{
+    for (uint8_t i = 0; i <= ins.x; ++i)
+    {
+        c.memory[(c.I + i) & (MEMORY_SIZE - 1)] = c.V[i];
+    }
+    c.markWritten(c.I, ins.x + 1);
+    if constexpr (Quirks::LOAD_STORE_ADVANCES_I)
+    {
+        c.I += ins.x + 1;
+    }
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::opFx65(BasicChip8 &c, const Instruction &ins) // Fx65 - Read from memory at I into registers from V0 to Vx
+{
+    for (uint8_t i = 0; i <= ins.x; ++i)
+    {
+        c.V[i] = c.memory[(c.I + i) & (MEMORY_SIZE - 1)];
+    }
+    if constexpr (Quirks::LOAD_STORE_ADVANCES_I)
+    {
+        c.I += ins.x + 1;
+    }
+    c.pc += 2;
+}
+
+// Each pixel doubled into two bits: how low-resolution sprites land on the
+// full-size display
+static uint32_t doubleBits(uint32_t bits)
+{
+    bits = (bits | bits << 8) & 0x00FF00FF;
+    bits = (bits | bits << 4) & 0x0F0F0F0F;
+    bits = (bits | bits << 2) & 0x33333333;
+    bits = (bits | bits << 1) & 0x55555555;
+    return bits | bits << 1;
+}
+
+// SUPER-CHIP / XO-CHIP Dxyn: n rows of 8 pixels, or 16 rows of 16 for n = 0,
+// into every selected plane, each plane's data following the last. Low
+// resolution coordinates address 2x2 blocks. Clips or wraps at the edges
+// as the quirks say.
+template <typename Machine>
+void BasicChip8<Machine>::drawSprite(uint8_t x, uint8_t y, uint8_t n)
+{
+    const unsigned scale = mode.hires ? 1 : 2;
+    const unsigned px = (x % (DISPLAY_WIDTH / scale)) * scale;
+    const unsigned py = (y % (DISPLAY_HEIGHT / scale)) * scale;
+    const unsigned rows = n == 0 ? 16 : n;
+    const unsigned rowBytes = n == 0 ? 2 : 1;
+    const unsigned width = 8 * rowBytes * scale;
+    uint16_t address = I;
+    Row collision = 0;
+
+    for (int plane = 0; plane < PLANES; ++plane)
+    {
+        if (!(mode.planes & (1u << plane)))
+        {
+            continue;
+        }
+        Row *target = &display[plane * DISPLAY_HEIGHT];
+        for (unsigned row = 0; row < rows; ++row, address += rowBytes)
+        {
+            uint32_t data = memory[address & (MEMORY_SIZE - 1)];
+            if (rowBytes == 2)
+            {
+                data = data << 8 | memory[(address + 1) & (MEMORY_SIZE - 1)];
+            }
+            if (scale == 2)
+            {
+                data = doubleBits(data);
+            }
+            const Row sprite = static_cast<Row>(data) << (DISPLAY_WIDTH - width);
+            const Row bits = Quirks::SPRITES_WRAP ? rotateRight(sprite, px) : sprite >> px;
+            for (unsigned y = py + row * scale; y < py + (row + 1) * scale; ++y)
+            {
+                if (!Quirks::SPRITES_WRAP && y >= DISPLAY_HEIGHT)
+                {
+                    break;
+                }
+                const unsigned line = y % DISPLAY_HEIGHT;
+                collision |= target[line] & bits;
+                target[line] ^= bits;
+                dirtyRows |= static_cast<RowMask>(bits != 0) << line;
+            }
+        }
+    }
+
+    V[0xF] = collision != 0;
+}
+
+// Moves the selected planes by whole pixels of the current resolution;
+// pixels scrolled in are off
+template <typename Machine>
+void BasicChip8<Machine>::scroll(int down, int right)
+{
+    const int scale = mode.hires ? 1 : 2;
+    down *= scale;
+    right *= scale;
+    for (int plane = 0; plane < PLANES; ++plane)
+    {
+        if (!(mode.planes & (1u << plane)))
+        {
+            continue;
+        }
+        Row *rows = &display[plane * DISPLAY_HEIGHT];
+        if (down > 0)
+        {
+            std::copy_backward(rows, rows + DISPLAY_HEIGHT - down, rows + DISPLAY_HEIGHT);
+            std::fill_n(rows, down, Row(0));
+        }
+        else if (down < 0)
+        {
+            std::copy(rows - down, rows + DISPLAY_HEIGHT, rows);
+            std::fill_n(rows + DISPLAY_HEIGHT + down, -down, Row(0));
+        }
+        for (int line = 0; line < DISPLAY_HEIGHT && right != 0; ++line)
+        {
+            rows[line] = right > 0 ? rows[line] >> right : rows[line] << -right;
+        }
+    }
+    dirtyRows = ALL_ROWS;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::op00Cn(BasicChip8 &c, const Instruction &ins) // 00Cn - scroll down n rows
+{
+    c.scroll(ins.n, 0);
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::op00Dn(BasicChip8 &c, const Instruction &ins) // 00Dn - scroll up n rows
+{
+    c.scroll(-ins.n, 0);
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::op00FB(BasicChip8 &c, const Instruction &) // 00FB - scroll right 4 pixels
+{
+    c.scroll(0, 4);
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::op00FC(BasicChip8 &c, const Instruction &) // 00FC - scroll left 4 pixels
+{
+    c.scroll(0, -4);
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::op00FD(BasicChip8 &, const Instruction &) // 00FD - exit the interpreter
+{
+    // Stays put; waitState() reports it as a halt
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::op00FE(BasicChip8 &c, const Instruction &) // 00FE - low resolution
+{
+    c.mode.hires = 0;
+    c.display.fill(0);
+    c.dirtyRows = ALL_ROWS;
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::op00FF(BasicChip8 &c, const Instruction &) // 00FF - high resolution
+{
+    c.mode.hires = 1;
+    c.display.fill(0);
+    c.dirtyRows = ALL_ROWS;
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::op5xy2(BasicChip8 &c, const Instruction &ins) // 5xy2 - store Vx..Vy (either order) at I
+{
+    const int step = ins.x <= ins.y ? 1 : -1;
+    const unsigned count = std::abs(ins.x - ins.y) + 1;
+    for (unsigned i = 0; i < count; ++i)
+    {
+        c.memory[(c.I + i) & (MEMORY_SIZE - 1)] = c.V[ins.x + step * static_cast<int>(i)];
+    }
+    c.markWritten(c.I, count);
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::op5xy3(BasicChip8 &c, const Instruction &ins) // 5xy3 - load Vx..Vy (either order) from I
+{
+    const int step = ins.x <= ins.y ? 1 : -1;
+    const unsigned count = std::abs(ins.x - ins.y) + 1;
+    for (unsigned i = 0; i < count; ++i)
+    {
+        c.V[ins.x + step * static_cast<int>(i)] = c.memory[(c.I + i) & (MEMORY_SIZE - 1)];
+    }
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::opF000(BasicChip8 &c, const Instruction &) // F000 nnnn - I = the 16-bit word after
+{
+    c.I = c.opcodeAt(c.pc + 2);
+    c.pc += 4;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::opFn01(BasicChip8 &c, const Instruction &ins) // Fn01 - select bitplanes n
+{
+    c.mode.planes = ins.x & ((1u << PLANES) - 1);
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::opF002(BasicChip8 &c, const Instruction &) // F002 - load the 16-byte audio pattern from I
+{
+    for (size_t i = 0; i < c.mode.pattern.size(); ++i)
+    {
+        c.mode.pattern[i] = c.memory[(c.I + i) & (MEMORY_SIZE - 1)];
+    }
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::opFx30(BasicChip8 &c, const Instruction &ins) // Fx30 - I = big digit Vx
+{
+    c.I = BIG_FONT_START + (c.V[ins.x] & 0xF) * 10;
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::opFx3A(BasicChip8 &c, const Instruction &ins) // Fx3A - audio pitch = Vx
+{
+    c.mode.pitch = c.V[ins.x];
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::opFx75(BasicChip8 &c, const Instruction &ins) // Fx75 - store V0..Vx in the flag registers
+{
+    const unsigned last = std::min<unsigned>(ins.x, FLAG_COUNT - 1);
+    std::copy(c.V.begin(), c.V.begin() + last + 1, c.mode.flags.begin());
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::opFx85(BasicChip8 &c, const Instruction &ins) // Fx85 - load V0..Vx from the flag registers
+{
+    const unsigned last = std::min<unsigned>(ins.x, FLAG_COUNT - 1);
+    std::copy(c.mode.flags.begin(), c.mode.flags.begin() + last + 1, c.V.begin());
+    c.pc += 2;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::opUnknown(BasicChip8 &, const Instruction &ins)
+{
+    std::cerr << "Unknown opcode: 0x" << std::hex << ins.opcode << std::dec << std::endl;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::opDecode(BasicChip8 &c, const Instruction &)
+{
+    Instruction &entry = c.decodeCache[c.pc & (MEMORY_SIZE - 1)];
+    entry = decode(c.fetchOpcode());
+    const Instruction ins = entry;
+    ins.handler(c, ins);
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::emulateCycle()
+{
+#ifdef CHIP8_DISPATCH_SWITCH
+    const Instruction ins = decode(fetchOpcode());
+#else
+    // Copied because a handler that writes memory may replace its own entry
+    const Instruction ins = decodeCache[pc & (MEMORY_SIZE - 1)];
+#endif
+#ifdef CHIP8_PROFILE
+    profileStep();
+#endif
+    ins.handler(*this, ins);
+}
+
+// Executes exactly `cycles` instructions; same result as calling
+// emulateCycle() that many times.
+template <typename Machine>
+void BasicChip8<Machine>::run(unsigned long long cycles)
+{
+    // Nothing inside a run() changes the keypad or ticks the timers, so a
+    // wait state at the start lasts for all of it
+    const WaitState wait = waitState();
+    if (wait != WaitState::None)
+    {
+#ifdef CHIP8_PROFILE
+        if (profile)
+        {
+            profile->skipped(cycles);
+        }
+#endif
+        skipWait(wait, cycles);
+        return;
+    }
+
+#ifdef CHIP8_NO_BLOCKS
+    for (unsigned long long i = 0; i < cycles; ++i)
+    {
+        emulateCycle();
+    }
+#else
+    while (cycles > 0)
+    {
+        const uint16_t start = pc & (MEMORY_SIZE - 1);
+        const Block &block = blocks[start].length != 0 ? blocks[start] : compileBlock(start);
+        const uint32_t first = block.first;
+        const unsigned length = static_cast<unsigned>(std::min<unsigned long long>(block.length, cycles));
+        cycles -= length;
+
+        // Only the last instruction can flush the pool, so the others are
+        // safe to run in place; the last is copied before it executes.
+        for (unsigned i = 0; i + 1 < length; ++i)
+        {
+            const Instruction &ins = blockPool[first + i];
+#ifdef CHIP8_PROFILE
+            profileStep();
+#endif
+            ins.handler(*this, ins);
+        }
+        const Instruction last = blockPool[first + length - 1];
+#ifdef CHIP8_PROFILE
+        profileStep();
+#endif
+        last.handler(*this, last);
+    }
+#endif
+}
+
+// Finds the "Fx07; 3x00; jump to the Fx07" delay poll that pc is in, if
+// any, and whether it will keep looping: it exits once the 3x00 sees Vx = 0.
+template <typename Machine>
+bool BasicChip8<Machine>::delayLoopHead(uint16_t &head) const
+{
+    for (uint16_t offset = 0; offset <= 4; offset += 2)
+    {
+        const uint16_t start = pc - offset;
+        if (start > pc || start > MEMORY_SIZE - 6)
+        {
+            continue;
+        }
+        if (isDelayPoll(start))
+        {
+            head = start;
+            return delayTimer > 0 && (offset != 2 || V[(opcodeAt(start) & 0x0F00) >> 8] != 0);
+        }
+    }
+    return false;
+}
+
+// Whether "Fx07; 3x00; jump to the Fx07" starts at `start`
+template <typename Machine>
+bool BasicChip8<Machine>::isDelayPoll(uint16_t start) const
+{
+    const uint16_t read = opcodeAt(start);
+    const uint8_t x = (read & 0x0F00) >> 8;
+    // 1nnn reaches only the first 4K, so on XO-CHIP a poll at or above
+    // 0x1000 jumps elsewhere and is no loop
+    const uint16_t jump = opcodeAt(start + 4);
+    return (read & 0xF0FF) == 0xF007 && opcodeAt(start + 2) == (0x3000 | (x << 8)) &&
+           (jump & 0xF000) == 0x1000 && (jump & 0x0FFF) == start;
+}
+
+template <typename Machine>
+typename BasicChip8<Machine>::WaitState BasicChip8<Machine>::waitState() const
+{
+    // Cheap reject first: run() asks before every frame's worth of cycles.
+    // At pc these loops sit on a 1nnn, 3xkk or Fxkk. pc is masked the way
+    // fetches mask it, so a jump past the end is judged where it lands.
+    const uint16_t at = pc & (MEMORY_SIZE - 1);
+    const unsigned group = memory[at] >> 4;
+    if (group != 0x1 && group != 0x3 && group != 0xF && (!Machine::SUPER_CHIP || group != 0x0))
+    {
+        return WaitState::None;
+    }
+    const uint16_t opcode = opcodeAt(pc);
+    if (Machine::SUPER_CHIP && opcode == 0x00FD)
+    {
+        return WaitState::Halt;
+    }
+    if ((opcode & 0xF0FF) == 0xF00A && keypadMask() == 0)
+    {
+        return WaitState::Key;
+    }
+    if ((opcode & 0xF000) == 0x1000 && (opcode & 0x0FFF) == at)
+    {
+        return WaitState::Halt;
+    }
+    uint16_t head = 0;
+    return delayLoopHead(head) ? WaitState::Timer : WaitState::None;
+}
+
+template <typename Machine>
+typename BasicChip8<Machine>::Analysis BasicChip8<Machine>::analyze(size_t programSize) const
+{
+    Analysis analysis;
+    analysis.programSize = programSize;
+
+    // Pass 1: reachable instructions, their successors, and the addresses
+    // that start a basic block (entry, branch targets, fall-throughs after
+    // a branch)
+    struct Step
+    {
+        std::vector<uint16_t> next;
+        bool branches = true; // Anything but falling through to the following instruction
+    };
+    std::map<uint16_t, Step> steps; // By instruction address
+    std::bitset<MEMORY_SIZE> leaders;
+    std::set<uint16_t> subroutines;
+    std::vector<uint16_t> pending = {PROGRAM_START};
+    leaders[PROGRAM_START] = true;
+    while (!pending.empty())
+    {
+        const uint16_t address = pending.back();
+        pending.pop_back();
+        if (steps.count(address))
+        {
+            continue;
+        }
+
+        const uint16_t opcode = opcodeAt(address);
+        const Handler handler = lookupHandler(opcode);
+        if (handler == &opUnknown)
+        {
+            continue; // Not an instruction; the path runs into data
+        }
+
+        const auto next = [&](int offset) { return static_cast<uint16_t>((address + offset) & (MEMORY_SIZE - 1)); };
+        Step &step = steps[address];
+        std::vector<uint16_t> &out = step.next;
+        unsigned length = 2;
+        if (handler == &op1nnn)
+        {
+            out = {static_cast<uint16_t>(opcode & 0x0FFF)};
+        }
+        else if (handler == &op2nnn)
+        {
+            out = {static_cast<uint16_t>(opcode & 0x0FFF), next(2)};
+            subroutines.insert(opcode & 0x0FFF);
+        }
+        else if (handler == &op00EE || handler == &opBnnn || (Machine::SUPER_CHIP && handler == &op00FD))
+        {
+            if (handler == &opBnnn)
+            {
+                analysis.indirectJumps.push_back(address);
+            }
+        }
+        else if (handler == &op3xkk || handler == &op4xkk || handler == &op5xy0 || handler == &op9xy0 ||
+                 handler == &opEx9E || handler == &opExA1)
+        {
+            const bool overLong = Machine::XO_CHIP && opcodeAt(next(2)) == 0xF000;
+            out = {next(2), next(overLong ? 6 : 4)};
+        }
+        else
+        {
+            if (Machine::XO_CHIP && handler == &opF000)
+            {
+                length = 4;
+            }
+            out = {next(length)};
+            step.branches = false;
+        }
+
+        for (unsigned i = 0; i < length; ++i)
+        {
+            analysis.code[next(i)] = true;
+        }
+        for (uint16_t target : out)
+        {
+            leaders[target] = leaders[target] || step.branches;
+            pending.push_back(target);
+        }
+    }
+    analysis.subroutines.assign(subroutines.begin(), subroutines.end());
+    std::sort(analysis.indirectJumps.begin(), analysis.indirectJumps.end());
+
+    // Pass 2: cut the instructions into blocks. A block runs until a
+    // branch, or until the next instruction starts another block.
+    typename Analysis::BasicBlock *open = nullptr;
+    for (const auto &entry : steps)
+    {
+        const uint16_t address = entry.first;
+        if (!open || leaders[address] || open->successors[0] != address)
+        {
+            open = &analysis.blocks[address];
+            open->start = address;
+        }
+        open->last = address;
+        open->successors = entry.second.next;
+        if (entry.second.branches)
+        {
+            open = nullptr;
+        }
+    }
+
+    // Loops: back edges, plus Fx0A, which loops on itself until a key
+    for (const auto &entry : steps)
+    {
+        const uint16_t address = entry.first;
+        const uint16_t opcode = opcodeAt(address);
+        if ((opcode & 0xF0FF) == 0xF00A)
+        {
+            analysis.loops.push_back({address, address, 1, WaitState::Key});
+            continue;
+        }
+        for (uint16_t target : entry.second.next)
+        {
+            if (target > address)
+            {
+                continue;
+            }
+            typename Analysis::Loop loop{target, address, static_cast<unsigned>((address - target) / 2 + 1),
+                                         WaitState::None};
+            if (target == address && (opcode & 0xF000) == 0x1000)
+            {
+                loop.wait = WaitState::Halt;
+            }
+            else if (isDelayPoll(target) && address == target + 4)
+            {
+                loop.wait = WaitState::Timer;
+            }
+            analysis.loops.push_back(loop);
+        }
+    }
+    std::sort(analysis.loops.begin(), analysis.loops.end(),
+              [](const typename Analysis::Loop &a, const typename Analysis::Loop &b) { return a.head < b.head; });
+    return analysis;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::Analysis::write(std::ostream &out) const
+{
+    const std::ios::fmtflags flags = out.flags();
+    out << std::hex << std::uppercase << std::setfill('0');
+
+    size_t programCode = 0;
+    for (size_t i = 0; i < programSize; ++i)
+    {
+        programCode += code[(PROGRAM_START + i) & (MEMORY_SIZE - 1)];
+    }
+    out << std::dec << "Program: " << programSize << " bytes, " << programCode << " code, "
+        << programSize - programCode << " data; " << blocks.size() << " blocks, " << loops.size() << " loops"
+        << std::hex << std::endl;
+
+    out << "Subroutines:";
+    for (uint16_t address : subroutines)
+    {
+        out << ' ' << std::setw(3) << address;
+    }
+    out << std::endl << "Indirect jumps:";
+    for (uint16_t address : indirectJumps)
+    {
+        out << ' ' << std::setw(3) << address;
+    }
+    out << std::endl;
+
+    static const char *const WAIT_NAMES[] = {"", " key wait", " halt", " delay wait"};
+    out << "Loops:" << std::endl;
+    for (const Loop &loop : loops)
+    {
+        out << "  " << std::setw(3) << loop.head << '-' << std::setw(3) << loop.tail << std::dec << ' '
+            << loop.instructions << (loop.instructions == 1 ? " instruction" : " instructions")
+            << WAIT_NAMES[static_cast<int>(loop.wait)] << std::hex << std::endl;
+    }
+
+    out << "Blocks:" << std::endl;
+    for (const auto &entry : blocks)
+    {
+        const BasicBlock &block = entry.second;
+        out << "  " << std::setw(3) << block.start << '-' << std::setw(3) << block.last << " ->";
+        for (uint16_t next : block.successors)
+        {
+            out << ' ' << std::setw(3) << next;
+        }
+        out << std::endl;
+    }
+
+    // Code/data map of the program, 64 bytes a line: 'c' code, '.' data
+    out << "Map:";
+    for (size_t i = 0; i < programSize; ++i)
+    {
+        if (i % 64 == 0)
+        {
+            out << std::endl << "  " << std::setw(3) << PROGRAM_START + i << ' ';
+        }
+        out << (code[(PROGRAM_START + i) & (MEMORY_SIZE - 1)] ? 'c' : '.');
+    }
+    out << std::endl;
+
+    out.flags(flags);
+}
+
+// Frames, counting the next, before the current wait can end without a key
+// change: until the delay timer reads 0 for a delay poll, and until both
+// timers stop for the others (after which nothing changes at all).
+template <typename Machine>
+unsigned BasicChip8<Machine>::idleFrames() const
+{
+    switch (waitState())
+    {
+    case WaitState::None:
+        return 0;
+    case WaitState::Timer:
+        return delayTimer;
+    default:
+        return delayTimer == 0 && soundTimer == 0 ? IDLE_UNTIL_INPUT : std::max(delayTimer, soundTimer);
+    }
+}
+
+// Leaves the machine exactly as running `cycles` instructions of the wait
+// loop would
+template <typename Machine>
+void BasicChip8<Machine>::skipWait(WaitState state, unsigned long long cycles)
+{
+    uint16_t head = 0;
+    if (state != WaitState::Timer || !delayLoopHead(head))
+    {
+        return; // Fx0A and a jump to self never change anything
+    }
+
+    // The poll is a 3-instruction cycle; the Fx07 at its head loads the
+    // timer, which holds still until the next tick.
+    const unsigned position = (pc - head) / 2;
+    const unsigned firstRead = (3 - position) % 3;
+    if (cycles > firstRead)
+    {
+        V[(opcodeAt(head) & 0x0F00) >> 8] = delayTimer;
+    }
+    pc = head + 2 * ((position + cycles) % 3);
+}
+
+// Timers count down at 60 Hz independent of the instruction rate; the
+// scheduler calls this once per frame.
+template <typename Machine>
+void BasicChip8<Machine>::tickTimers()
+{
+    if (delayTimer > 0)
+    {
+        --delayTimer;
+    }
+
+    if (soundTimer > 0)
+    {
+        --soundTimer;
+    }
+}
+
+
+template <typename Machine>
+void BasicChip8<Machine>::setKeyState(uint8_t key, bool pressed)
+{
+    if (key < KEYPAD_SIZE)
+    {
+        keypad[key] = pressed;
+    }
+}
+
+// Bit n of mask is key n
+template <typename Machine>
+void BasicChip8<Machine>::setKeypadMask(uint16_t mask)
+{
+    for (int i = 0; i < KEYPAD_SIZE; ++i)
+    {
+        keypad[i] = (mask >> i) & 1;
+    }
+}
+
+template <typename Machine>
+uint16_t BasicChip8<Machine>::keypadMask() const
+{
+    uint16_t mask = 0;
+    for (int i = 0; i < KEYPAD_SIZE; ++i)
+    {
+        mask |= static_cast<uint16_t>(keypad[i] ? 1 : 0) << i;
+    }
+    return mask;
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::seedRandom(uint64_t seed)
+{
+    rngState = mixSeed(seed);
+    bootRngState = rngState;
+}
+
+template <typename Machine>
+uint8_t BasicChip8<Machine>::nextRandom()
+{
+    return xorshiftNext(rngState);
+}
+
+// Hash of the display and registers; equal hashes after the same run mean
+// the ROM produced the same picture and CPU state. Chip8Lanes::stateHash
+// must feed the same fields in the same order.
+template <typename Machine>
+uint64_t BasicChip8<Machine>::stateHash() const
+{
+    StateHash hash;
+    for (Row row : display)
+    {
+        for (int word = 0; word < ROW_WORDS; ++word)
+        {
+            hash.mix(rowWord(row, word), 8);
+        }
+    }
+    for (uint8_t value : V)
+    {
+        hash.mix(value, 1);
+    }
+    for (uint16_t i = 0; i < sp && i < STACK_SIZE; ++i)
+    {
+        hash.mix(stack[i], 2);
+    }
+    hash.mix(I, 2);
+    hash.mix(pc, 2);
+    hash.mix(sp, 2);
+    hash.mix(delayTimer, 1);
+    hash.mix(soundTimer, 1);
+    if constexpr (Machine::SUPER_CHIP)
+    {
+        hash.mix(mode.hires, 1);
+        hash.mix(mode.planes, 1);
+        for (unsigned i = 0; i < FLAG_COUNT; ++i)
+        {
+            hash.mix(mode.flags[i], 1);
+        }
+    }
+    return hash.value();
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::dumpState(std::ostream &out) const
+{
+    const std::ios::fmtflags flags = out.flags();
+    out << std::hex << std::uppercase << std::setfill('0');
+
+    out << "PC=" << std::setw(3) << pc << " I=" << std::setw(3) << I
+        << " SP=" << std::setw(1) << sp
+        << " DT=" << std::setw(2) << +delayTimer << " ST=" << std::setw(2) << +soundTimer << std::endl;
+
+    for (int i = 0; i < REGISTER_COUNT; ++i)
+    {
+        out << 'V' << std::setw(1) << i << '=' << std::setw(2) << +V[i] << (i + 1 < REGISTER_COUNT ? ' ' : '\n');
+    }
+
+    out << "Stack:";
+    for (uint16_t i = 0; i < sp && i < STACK_SIZE; ++i)
+    {
+        out << ' ' << std::setw(3) << stack[i];
+    }
+    out << std::endl;
+
+    // With two planes: '#' plane 0, '+' plane 1, '@' both
+    for (int y = 0; y < DISPLAY_HEIGHT; ++y)
+    {
+        for (int x = 0; x < DISPLAY_WIDTH; ++x)
+        {
+            unsigned color = 0;
+            for (int plane = 0; plane < PLANES; ++plane)
+            {
+                color |= static_cast<unsigned>(display[plane * DISPLAY_HEIGHT + y] >> (DISPLAY_WIDTH - 1 - x) & 1) << plane;
+            }
+            out << ".#+@"[color];
+        }
+        out << '\n';
+    }
+
+    out.flags(flags);
+}
+
+template <typename Machine>
+typename BasicChip8<Machine>::CoreState BasicChip8<Machine>::coreState() const
+{
+    return CoreState{V, stack, display, I, pc, sp, delayTimer, soundTimer, dirtyRows, rngState, mode};
+}
+
+template <typename Machine>
+void BasicChip8<Machine>::setCoreState(const CoreState &state)
+{
+    V = state.V;
+    stack = state.stack;
+    display = state.display;
+    I = state.I;
+    pc = state.pc;
+    sp = state.sp;
+    delayTimer = state.delayTimer;
+    soundTimer = state.soundTimer;
+    dirtyRows = state.dirtyRows;
+    rngState = state.rngState;
+    mode = state.mode;
+#ifdef CHIP8_PROFILE
+    if (profile)
+    {
+        profile->unwind();
+    }
+#endif
+}
+
+static void putLE(std::vector<uint8_t> &out, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; ++i)
+    {
+        out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+    }
+}
+
+static uint64_t getLE(const uint8_t *&in, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i)
+    {
+        value |= static_cast<uint64_t>(*in++) << (8 * i);
+    }
+    return value;
+}
+
+const char SAVE_STATE_MAGIC[4] = {'C', '8', 'S', 'T'};
+
+// Save-state layout, all integers little-endian:
+//   "C8ST", version, machine ID, memory, V, stack, display rows (64-bit
+//   words, leftmost first, plane by plane), I, pc, sp, delayTimer,
+//   soundTimer, draw pending (any dirty row), rngState, then for SUPER-CHIP
+//   and XO-CHIP: hires, planes, flag registers, and for XO-CHIP the pitch
+//   and audio pattern
+template <typename Machine>
+std::vector<uint8_t> BasicChip8<Machine>::saveState() const
+{
+    std::vector<uint8_t> out(SAVE_STATE_MAGIC, SAVE_STATE_MAGIC + sizeof(SAVE_STATE_MAGIC));
+    out.reserve(SAVE_STATE_SIZE);
+    out.push_back(SAVE_STATE_VERSION);
+    out.push_back(Machine::ID);
+    out.insert(out.end(), memory.begin(), memory.end());
+    out.insert(out.end(), V.begin(), V.end());
+    for (uint16_t entry : stack)
+    {
+        putLE(out, entry, 2);
+    }
+    for (Row row : display)
+    {
+        for (int word = 0; word < ROW_WORDS; ++word)
+        {
+            putLE(out, rowWord(row, word), 8);
+        }
+    }
+    putLE(out, I, 2);
+    putLE(out, pc, 2);
+    putLE(out, sp, 2);
+    out.push_back(delayTimer);
+    out.push_back(soundTimer);
+    out.push_back(dirtyRows != 0);
+    putLE(out, rngState, 8);
+    if constexpr (Machine::SUPER_CHIP)
+    {
+        out.push_back(mode.hires);
+        out.push_back(mode.planes);
+        out.insert(out.end(), mode.flags.begin(), mode.flags.begin() + FLAG_COUNT);
+    }
+    if constexpr (Machine::XO_CHIP)
+    {
+        out.push_back(mode.pitch);
+        out.insert(out.end(), mode.pattern.begin(), mode.pattern.end());
+    }
+    return out;
+}
+
+template <typename Machine>
+bool BasicChip8<Machine>::loadState(const std::vector<uint8_t> &state)
+{
+    if (state.size() <= sizeof(SAVE_STATE_MAGIC) || !std::equal(SAVE_STATE_MAGIC, SAVE_STATE_MAGIC + sizeof(SAVE_STATE_MAGIC), state.begin()))
+    {
+        std::cerr << "Not a save state" << std::endl;
+        return false;
+    }
+
+    const uint8_t *in = state.data() + sizeof(SAVE_STATE_MAGIC);
+    const uint8_t version = *in++;
+    if (version != SAVE_STATE_VERSION)
+    {
+        std::cerr << "Unsupported save state version: " << +version << std::endl;
+        return false;
+    }
+
+    if (state.size() > sizeof(SAVE_STATE_MAGIC) + 1 && *in != Machine::ID)
+    {
+        std::cerr << "Save state is for another machine (ID " << +*in << ")" << std::endl;
+        return false;
+    }
+    ++in;
+
+    if (state.size() != SAVE_STATE_SIZE)
+    {
+        std::cerr << "Truncated save state" << std::endl;
+        return false;
+    }
+
+    std::copy(in, in + MEMORY_SIZE, memory.begin());
+    in += MEMORY_SIZE;
+    std::copy(in, in + REGISTER_COUNT, V.begin());
+    in += REGISTER_COUNT;
+    for (uint16_t &entry : stack)
+    {
+        entry = static_cast<uint16_t>(getLE(in, 2));
+    }
+    for (Row &row : display)
+    {
+        row = 0;
+        for (int word = 0; word < ROW_WORDS; ++word)
+        {
+            row = row << 32 << 32 | getLE(in, 8); // Two shifts: by 64 is undefined for one word
+        }
+    }
+    I = static_cast<uint16_t>(getLE(in, 2));
+    pc = static_cast<uint16_t>(getLE(in, 2));
+    sp = static_cast<uint16_t>(getLE(in, 2));
+    delayTimer = *in++;
+    soundTimer = *in++;
+    ++in; // Draw pending; every row is marked dirty below anyway
+    rngState = getLE(in, 8);
+    mode = ModeState{};
+    if constexpr (Machine::SUPER_CHIP)
+    {
+        mode.hires = *in++;
+        mode.planes = *in++;
+        std::copy(in, in + FLAG_COUNT, mode.flags.begin());
+        in += FLAG_COUNT;
+    }
+    if constexpr (Machine::XO_CHIP)
+    {
+        mode.pitch = *in++;
+        std::copy(in, in + mode.pattern.size(), mode.pattern.begin());
+        in += mode.pattern.size();
+    }
+
+    invalidateDecoded(0, MEMORY_SIZE);
+    dirtyPages = static_cast<uint16_t>((1u << PAGE_COUNT) - 1);
+    changedPages = dirtyPages;
+    dirtyRows = ALL_ROWS;
+    return true;
+}
+
+// Bounded in-memory history of machine states. Each snapshot keeps the
+// CoreState in full, but memory is kept as an undo log: when a snapshot is
+// captured, the previous one receives the old contents of just the pages
+// written in between. `shadow` mirrors memory as of the newest snapshot, so
+// stepping back only copies pages that actually changed. With typical ROMs
+// touching one page or none per frame a snapshot is a few hundred bytes.
+template <typename Machine>
+class BasicSnapshotRing
+{
+    using Core = BasicChip8<Machine>;
+
+public:
+    BasicSnapshotRing(size_t maxSnapshots, size_t maxBytes) : maxSnapshots(maxSnapshots), maxBytes(maxBytes) {}
+
+    void capture(Core &chip8);
+    bool rewind(Core &chip8);
+
+    void clear()
+    {
+        snapshots.clear();
+    }
+
+    size_t size() const
+    {
+        return snapshots.size();
+    }
+
+    // Approximate heap footprint of the stored history
+    size_t bytes() const
+    {
+        return totalBytes;
+    }
+
+private:
+    struct Snapshot
+    {
+        typename Core::CoreState core;
+        uint16_t undoMask = 0;      // Pages held in undoPages, lowest first
+        std::vector<uint8_t> undoPages;
+    };
+
+    size_t maxSnapshots;
+    size_t maxBytes;
+    size_t totalBytes = 0;
+    std::deque<Snapshot> snapshots;
+    std::array<uint8_t, Core::MEMORY_SIZE> shadow{};
+    static constexpr int PAGE_SIZE = Core::PAGE_SIZE;
+
+    static size_t footprint(const Snapshot &snapshot)
+    {
+        return sizeof(Snapshot) + snapshot.undoPages.capacity();
+    }
+};
+
+template <typename Machine>
+void BasicSnapshotRing<Machine>::capture(Core &chip8)
+{
+    if (snapshots.empty())
+    {
+        shadow = chip8.memory;
+    }
+    else if (chip8.dirtyPages != 0)
+    {
+        Snapshot &previous = snapshots.back();
+        const size_t reserved = previous.undoPages.capacity();
+        for (int page = 0; page < PAGE_COUNT; ++page)
+        {
+            if (chip8.dirtyPages & (1u << page))
+            {
+                const size_t offset = page * PAGE_SIZE;
+                previous.undoPages.insert(previous.undoPages.end(), shadow.begin() + offset, shadow.begin() + offset + PAGE_SIZE);
+                std::copy(chip8.memory.begin() + offset, chip8.memory.begin() + offset + PAGE_SIZE, shadow.begin() + offset);
+            }
+        }
+        previous.undoMask = chip8.dirtyPages;
+        totalBytes += previous.undoPages.capacity() - reserved;
+    }
+    chip8.dirtyPages = 0;
+
+    snapshots.push_back(Snapshot{chip8.coreState(), 0, {}});
+    totalBytes += sizeof(Snapshot);
+
+    // Oldest snapshots have nothing depending on them, so eviction is a pop
+    while (snapshots.size() > maxSnapshots || (totalBytes > maxBytes && snapshots.size() > 1))
+    {
+        totalBytes -= footprint(snapshots.front());
+        snapshots.pop_front();
+    }
+}
+
+// Restores the newest snapshot and drops it, so repeated calls walk back
+// through history. Returns false once the history is exhausted.
+template <typename Machine>
+bool BasicSnapshotRing<Machine>::rewind(Core &chip8)
+{
+    if (snapshots.empty())
+    {
+        return false;
+    }
+
+    // Pages written since the newest snapshot come back from the shadow
+    for (int page = 0; page < PAGE_COUNT; ++page)
+    {
+        if (chip8.dirtyPages & (1u << page))
+        {
+            const size_t offset = page * PAGE_SIZE;
+            std::copy(shadow.begin() + offset, shadow.begin() + offset + PAGE_SIZE, chip8.memory.begin() + offset);
+            chip8.invalidateDecoded(static_cast<uint16_t>(offset), PAGE_SIZE);
+            chip8.changedPages |= 1u << page;
+        }
+    }
+    chip8.dirtyPages = 0;
+    chip8.setCoreState(snapshots.back().core);
+    chip8.dirtyRows = Core::ALL_ROWS; // Unchanged rows are filtered out at render time
+
+    totalBytes -= footprint(snapshots.back());
+    snapshots.pop_back();
+
+    // Roll the shadow back to the new newest snapshot using its undo log
+    if (!snapshots.empty() && snapshots.back().undoMask != 0)
+    {
+        Snapshot &previous = snapshots.back();
+        const uint8_t *undo = previous.undoPages.data();
+        for (int page = 0; page < PAGE_COUNT; ++page)
+        {
+            if (previous.undoMask & (1u << page))
+            {
+                std::copy(undo, undo + PAGE_SIZE, shadow.begin() + page * PAGE_SIZE);
+                undo += PAGE_SIZE;
+            }
+        }
+        // Memory still matches the restored snapshot; those pages now
+        // differ from the shadow and are copied back on the next rewind.
+        chip8.dirtyPages = previous.undoMask;
+        totalBytes -= previous.undoPages.capacity();
+        previous.undoPages.clear();
+        previous.undoPages.shrink_to_fit();
+        previous.undoMask = 0;
+    }
+
+    return true;
+}
+
+using SnapshotRing = BasicSnapshotRing<ClassicMachine>;
+
+// Structure-of-arrays core running `Lanes` copies of one ROM in lockstep,
+// for search and fuzzing workloads that differ only in input or seed.
+// Registers, I, pc, sp, timers and RNG state are stored lane-major
+// (V[register][lane]) so that when all lanes sit on the same opcode every
+// operation is an element-wise loop over a short fixed-size array, which
+// GCC and Clang turn into SSE/AVX2/NEON code. Lanes that diverge are
+// grouped by pc and opcode and each group executes with a lane mask, so a
+// fully diverged set degrades to one scalar pass per lane. Memory, display
+// and stack are per lane since their accesses are indexed per lane anyway.
+//
+// Every lane follows exactly the semantics of Chip8 (and hashes the same),
+// except that out-of-range stack, keypad and memory indices wrap instead of
+// running off the end of the arrays.
+template <size_t Lanes>
+class Chip8Lanes
+{
+    // 32 lanes measured slower than 16 in --bench
+    static_assert(Lanes > 0 && Lanes <= 16, "lane sets are capped at 16 lanes");
+
+public:
+    using LaneMask = std::array<uint8_t, Lanes>; // 1 = lane takes part
+
+    // Every lane starts as a copy of `boot` (typically a freshly loaded ROM)
+    explicit Chip8Lanes(const Chip8 &boot) : lanes(Lanes)
+    {
+        for (size_t l = 0; l < Lanes; ++l)
+        {
+            for (int r = 0; r < REGISTER_COUNT; ++r)
+            {
+                V[r][l] = boot.V[r];
+            }
+            I[l] = boot.I;
+            pc[l] = boot.pc;
+            sp[l] = boot.sp;
+            delayTimer[l] = boot.delayTimer;
+            soundTimer[l] = boot.soundTimer;
+            rngState[l] = boot.rngState;
+            keypad[l] = 0;
+            lanes[l].memory = boot.memory;
+            lanes[l].display = boot.display;
+            lanes[l].stack = boot.stack;
+        }
+    }
+
+    void seedRandom(size_t lane, uint64_t seed)
+    {
+        rngState[lane] = mixSeed(seed);
+    }
+
+    void setKeypadMask(size_t lane, uint16_t mask)
+    {
+        keypad[lane] = mask;
+    }
+
+    void run(unsigned long long cycles)
+    {
+        for (unsigned long long i = 0; i < cycles; ++i)
+        {
+            step();
+        }
+    }
+
+    void tickTimers()
+    {
+        for (size_t l = 0; l < Lanes; ++l)
+        {
+            delayTimer[l] -= delayTimer[l] > 0;
+            soundTimer[l] -= soundTimer[l] > 0;
+        }
+    }
+
+    // Same fields and order as Chip8::stateHash
+    uint64_t stateHash(size_t lane) const
+    {
+        StateHash hash;
+        for (uint64_t row : lanes[lane].display)
+        {
+            hash.mix(row, 8);
+        }
+        for (int r = 0; r < REGISTER_COUNT; ++r)
+        {
+            hash.mix(V[r][lane], 1);
+        }
+        for (uint16_t i = 0; i < sp[lane] && i < STACK_SIZE; ++i)
+        {
+            hash.mix(lanes[lane].stack[i], 2);
+        }
+        hash.mix(I[lane], 2);
+        hash.mix(pc[lane], 2);
+        hash.mix(sp[lane], 2);
+        hash.mix(delayTimer[lane], 1);
+        hash.mix(soundTimer[lane], 1);
+        return hash.value();
+    }
+
+    // Lanes currently executing in lockstep with lane 0, for diagnostics
+    size_t convergedLanes() const
+    {
+        size_t count = 0;
+        for (size_t l = 0; l < Lanes; ++l)
+        {
+            count += pc[l] == pc[0];
+        }
+        return count;
+    }
+
+private:
+    struct LaneState
+    {
+        std::array<uint8_t, MEMORY_SIZE> memory;
+        std::array<uint64_t, DISPLAY_HEIGHT> display;
+        std::array<uint16_t, STACK_SIZE> stack;
+    };
+
+    std::array<std::array<uint8_t, Lanes>, REGISTER_COUNT> V{};
+    std::array<uint16_t, Lanes> I{};
+    std::array<uint16_t, Lanes> pc{};
+    std::array<uint16_t, Lanes> sp{};
+    std::array<uint8_t, Lanes> delayTimer{};
+    std::array<uint8_t, Lanes> soundTimer{};
+    std::array<uint16_t, Lanes> keypad{}; // Bit n = key n
+    std::array<uint64_t, Lanes> rngState{};
+    std::vector<LaneState> lanes;
+
+    void step();
+    void execute(uint16_t opcode, const LaneMask &on);
+
+    void advance(const LaneMask &on)
+    {
+        for (size_t l = 0; l < Lanes; ++l)
+        {
+            pc[l] += 2 * on[l];
+        }
+    }
+
+    // pc += 4 where `taken`, else 2, for active lanes
+    void skipIf(const LaneMask &on, const LaneMask &taken)
+    {
+        for (size_t l = 0; l < Lanes; ++l)
+        {
+            pc[l] += on[l] * (2 + 2 * taken[l]);
+        }
+    }
+};
+
+template <size_t Lanes>
+void Chip8Lanes<Lanes>::step()
+{
+    std::array<uint16_t, Lanes> opcodes;
+    for (size_t l = 0; l < Lanes; ++l)
+    {
+        const std::array<uint8_t, MEMORY_SIZE> &memory = lanes[l].memory;
+        opcodes[l] = (memory[pc[l] & (MEMORY_SIZE - 1)] << 8) | memory[(pc[l] + 1) & (MEMORY_SIZE - 1)];
+    }
+
+    // Converged: one pass with every lane on, no grouping
+    bool converged = true;
+    for (size_t l = 0; l < Lanes; ++l)
+    {
+        converged &= pc[l] == pc[0] && opcodes[l] == opcodes[0];
+    }
+    if (converged)
+    {
+        LaneMask all;
+        all.fill(1);
+        execute(opcodes[0], all);
+        return;
+    }
+
+    uint64_t pending = Lanes == 64 ? ~0ULL : (1ULL << Lanes) - 1;
+    while (pending != 0)
+    {
+        // The lowest pending lane leads a group of every lane on its pc and
+        // opcode; in the common converged case that is all of them.
+        const size_t leader = static_cast<size_t>(__builtin_ctzll(pending));
+        LaneMask on;
+        uint64_t group = 0;
+        for (size_t l = 0; l < Lanes; ++l)
+        {
+            on[l] = ((pending >> l) & 1) && pc[l] == pc[leader] && opcodes[l] == opcodes[leader];
+            group |= static_cast<uint64_t>(on[l]) << l;
+        }
+
+        execute(opcodes[leader], on);
+        pending &= ~group;
+    }
+}
+
+template <size_t Lanes>
+void Chip8Lanes<Lanes>::execute(uint16_t opcode, const LaneMask &on)
+{
+    const unsigned x = (opcode & 0x0F00) >> 8;
+    const unsigned y = (opcode & 0x00F0) >> 4;
+    const uint8_t kk = opcode & 0x00FF;
+    const uint16_t nnn = opcode & 0x0FFF;
+    std::array<uint8_t, Lanes> &Vx = V[x];
+    std::array<uint8_t, Lanes> &Vy = V[y];
+    std::array<uint8_t, Lanes> &VF = V[0xF];
+    LaneMask taken;
+
+    // Statements below mirror the Chip8 handlers one for one, each as a
+    // loop over lanes, so aliasing between Vx, Vy and VF resolves the same.
+    switch (opcode & 0xF000)
+    {
+    case 0x0000:
+        if (opcode == 0x00E0)
+        {
+            for (size_t l = 0; l < Lanes; ++l)
+            {
+                if (on[l])
+                {
+                    lanes[l].display.fill(0);
+                }
+            }
+            advance(on);
+        }
+        else if (opcode == 0x00EE)
+        {
+            for (size_t l = 0; l < Lanes; ++l)
+            {
+                if (on[l])
+                {
+                    --sp[l];
+                    pc[l] = lanes[l].stack[sp[l] & (STACK_SIZE - 1)] + 2;
+                }
+            }
+        }
+        break;
+    case 0x1000:
+        for (size_t l = 0; l < Lanes; ++l)
+        {
+            pc[l] = on[l] ? nnn : pc[l];
+        }
+        break;
+    case 0x2000:
+        for (size_t l = 0; l < Lanes; ++l)
+        {
+            if (on[l])
+            {
+                lanes[l].stack[sp[l] & (STACK_SIZE - 1)] = pc[l];
+                ++sp[l];
+                pc[l] = nnn;
+            }
+        }
+        break;
+    case 0x3000:
+        for (size_t l = 0; l < Lanes; ++l)
+        {
+            taken[l] = Vx[l] == kk;
+        }
+        skipIf(on, taken);
+        break;
+    case 0x4000:
+        for (size_t l = 0; l < Lanes; ++l)
+        {
+            taken[l] = Vx[l] != kk;
+        }
+        skipIf(on, taken);
+        break;
+    case 0x5000:
+        for (size_t l = 0; l < Lanes; ++l)
+        {
+            taken[l] = Vx[l] == Vy[l];
+        }
+        skipIf(on, taken);
+        break;
+    case 0x6000:
+        for (size_t l = 0; l < Lanes; ++l)
+        {
+            Vx[l] = on[l] ? kk : Vx[l];
+        }
+        advance(on);
+        break;
+    case 0x7000:
+        for (size_t l = 0; l < Lanes; ++l)
+        {
+            Vx[l] += on[l] * kk;
+        }
+        advance(on);
+        break;
+    case 0x8000:
+        switch (opcode & 0x000F)
+        {
+        case 0x0:
+            for (size_t l = 0; l < Lanes; ++l)
+            {
+                Vx[l] = on[l] ? Vy[l] : Vx[l];
+            }
+            break;
+        case 0x1:
+            for (size_t l = 0; l < Lanes; ++l)
+            {
+                Vx[l] = on[l] ? Vx[l] | Vy[l] : Vx[l];
+            }
+            break;
+        case 0x2:
+            for (size_t l = 0; l < Lanes; ++l)
+            {
+                Vx[l] = on[l] ? Vx[l] & Vy[l] : Vx[l];
+            }
+            break;
+        case 0x3:
+            for (size_t l = 0; l < Lanes; ++l)
+            {
+                Vx[l] = on[l] ? Vx[l] ^ Vy[l] : Vx[l];
+            }
+            break;
+        case 0x4:
+        {
+            std::array<uint16_t, Lanes> sum;
+            for (size_t l = 0; l < Lanes; ++l)
+            {
+                sum[l] = Vx[l] + Vy[l];
+            }
+            for (size_t l = 0; l < Lanes; ++l)
+            {
+                VF[l] = on[l] ? sum[l] > 0xFF : VF[l];
+            }
+            for (size_t l = 0; l < Lanes; ++l)
+            {
+                Vx[l] = on[l] ? static_cast<uint8_t>(sum[l]) : Vx[l];
+            }
+            break;
+        }
+        case 0x5:
+            for (size_t l = 0; l < Lanes; ++l)
+            {
+                VF[l] = on[l] ? Vx[l] > Vy[l] : VF[l];
+            }
+            for (size_t l = 0; l < Lanes; ++l)
+            {
+                Vx[l] = on[l] ? Vx[l] - Vy[l] : Vx[l];
+            }
+            break;
+        case 0x6:
+            // The source is read before VF is written, so 8Fy6 shifts the
+            // old VF and the shifted value overwrites the flag, as in Chip8
+            for (size_t l = 0; l < Lanes; ++l)
+            {
+                const uint8_t source = Vx[l];
+                VF[l] = on[l] ? source & 0x1 : VF[l];
+                Vx[l] = on[l] ? source >> 1 : Vx[l];
+            }
+            break;
+        case 0x7:
+            for (size_t l = 0; l < Lanes; ++l)
+            {
+                VF[l] = on[l] ? Vy[l] > Vx[l] : VF[l];
+            }
+            for (size_t l = 0; l < Lanes; ++l)
+            {
+                Vx[l] = on[l] ? Vy[l] - Vx[l] : Vx[l];
+            }
+            break;
+        case 0xE:
+            for (size_t l = 0; l < Lanes; ++l)
+            {
+                const uint8_t source = Vx[l];
+                VF[l] = on[l] ? (source & 0x80) >> 7 : VF[l];
+                Vx[l] = on[l] ? source << 1 : Vx[l];
+            }
+            break;
+        default:
+            return; // Unknown: pc stays, as in Chip8
+        }
+        advance(on);
+        break;
+    case 0x9000:
+        for (size_t l = 0; l < Lanes; ++l)
+        {
+            taken[l] = Vx[l] != Vy[l];
+        }
+        skipIf(on, taken);
+        break;
+    case 0xA000:
+        for (size_t l = 0; l < Lanes; ++l)
+        {
+            I[l] = on[l] ? nnn : I[l];
+        }
+        advance(on);
+        break;
+    case 0xB000:
+        for (size_t l = 0; l < Lanes; ++l)
+        {
+            pc[l] = on[l] ? nnn + V[0][l] : pc[l];
+        }
+        break;
+    case 0xC000:
+        for (size_t l = 0; l < Lanes; ++l)
+        {
+            if (on[l])
+            {
+                Vx[l] = xorshiftNext(rngState[l]) & kk;
+            }
+        }
+        advance(on);
+        break;
+    case 0xD000:
+        for (size_t l = 0; l < Lanes; ++l)
+        {
+            if (!on[l])
+            {
+                continue;
+            }
+            LaneState &lane = lanes[l];
+            const unsigned px = Vx[l] % DISPLAY_WIDTH;
+            const unsigned py = Vy[l] % DISPLAY_HEIGHT;
+            uint64_t collision = 0;
+            for (unsigned row = 0; row < (opcode & 0x000Fu) && py + row < DISPLAY_HEIGHT; ++row)
+            {
+                const uint64_t bits = (static_cast<uint64_t>(lane.memory[(I[l] + row) & (MEMORY_SIZE - 1)]) << 56) >> px;
+                collision |= lane.display[py + row] & bits;
+                lane.display[py + row] ^= bits;
+            }
+            VF[l] = collision != 0;
+        }
+        advance(on);
+        break;
+    case 0xE000:
+        if (kk != 0x9E && kk != 0xA1)
+        {
+            return;
+        }
+        for (size_t l = 0; l < Lanes; ++l)
+        {
+            const bool pressed = (keypad[l] >> (Vx[l] & 0xF)) & 1;
+            taken[l] = kk == 0x9E ? pressed : !pressed;
+        }
+        skipIf(on, taken);
+        break;
+    case 0xF000:
+        switch (kk)
+        {
+        case 0x07:
+            for (size_t l = 0; l < Lanes; ++l)
+            {
+                Vx[l] = on[l] ? delayTimer[l] : Vx[l];
+            }
+            break;
+        case 0x0A:
+            for (size_t l = 0; l < Lanes; ++l)
+            {
+                if (on[l] && keypad[l] != 0)
+                {
+                    Vx[l] = static_cast<uint8_t>(__builtin_ctz(keypad[l]));
+                    pc[l] += 2;
+                }
+            }
+            return;
+        case 0x15:
+            for (size_t l = 0; l < Lanes; ++l)
+            {
+                delayTimer[l] = on[l] ? Vx[l] : delayTimer[l];
+            }
+            break;
+        case 0x18:
+            for (size_t l = 0; l < Lanes; ++l)
+            {
+                soundTimer[l] = on[l] ? Vx[l] : soundTimer[l];
+            }
+            break;
+        case 0x1E:
+            for (size_t l = 0; l < Lanes; ++l)
+            {
+                I[l] += on[l] * Vx[l];
+            }
+            break;
+        case 0x29:
+            for (size_t l = 0; l < Lanes; ++l)
+            {
+                I[l] = on[l] ? FONT_START + (Vx[l] & 0xF) * 5 : I[l];
+            }
+            break;
+        case 0x33:
+            for (size_t l = 0; l < Lanes; ++l)
+            {
+                if (on[l])
+                {
+                    std::array<uint8_t, MEMORY_SIZE> &memory = lanes[l].memory;
+                    const uint8_t value = Vx[l];
+                    memory[I[l] & (MEMORY_SIZE - 1)] = value / 100;
+                    memory[(I[l] + 1) & (MEMORY_SIZE - 1)] = (value / 10) % 10;
+                    memory[(I[l] + 2) & (MEMORY_SIZE - 1)] = value % 10;
+                }
+            }
+            break;
+        case 0x55:
+            for (size_t l = 0; l < Lanes; ++l)
+            {
+                if (on[l])
+                {
+                    for (unsigned i = 0; i <= x; ++i)
+                    {
+                        lanes[l].memory[(I[l] + i) & (MEMORY_SIZE - 1)] = V[i][l];
+                    }
+                }
+            }
+            break;
+        case 0x65:
+            for (size_t l = 0; l < Lanes; ++l)
+            {
+                if (on[l])
+                {
+                    for (unsigned i = 0; i <= x; ++i)
+                    {
+                        V[i][l] = lanes[l].memory[(I[l] + i) & (MEMORY_SIZE - 1)];
+                    }
+                }
+            }
+            break;
+        default:
+            return;
+        }
+        advance(on);
+        break;
+    }
+}
+
+// Lock-free queue between exactly one producer thread and one consumer
+// thread. Neither side ever blocks: push fails when full, pop when empty.
+template <typename T, size_t Capacity>
+class SpscRing
+{
+    static_assert((Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+
+public:
+    bool push(const T &value)
+    {
+        const size_t tail = tailIndex.load(std::memory_order_relaxed);
+        if (tail - headIndex.load(std::memory_order_acquire) == Capacity)
+        {
+            return false;
+        }
+        slots[tail & (Capacity - 1)] = value;
+        tailIndex.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &value)
+    {
+        const size_t head = headIndex.load(std::memory_order_relaxed);
+        if (head == tailIndex.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        value = slots[head & (Capacity - 1)];
+        headIndex.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    std::array<T, Capacity> slots{};
+    alignas(64) std::atomic<size_t> headIndex{0}; // Written by the consumer
+    alignas(64) std::atomic<size_t> tailIndex{0}; // Written by the producer
+};
+
+// Lets one thread sleep until another signals it or a deadline passes.
+// Signals are counted, so one sent between reading count() and waiting
+// is not lost.
+class WakeSignal
+{
+public:
+    uint64_t count() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return signals;
+    }
+
+    void notify()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++signals;
+        }
+        changed.notify_all();
+    }
+
+    // Returns once the count differs from `seen`
+    void wait(uint64_t seen)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&] { return signals != seen; });
+    }
+
+    // Same, but gives up at `deadline`
+    void waitUntil(uint64_t seen, std::chrono::steady_clock::time_point deadline)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait_until(lock, deadline, [&] { return signals != seen; });
+    }
+
+private:
+    mutable std::mutex mutex;
+    std::condition_variable changed;
+    uint64_t signals = 0;
+};
+
+// A keypad change as seen by the event thread: the whole keypad after the
+// change, and when it happened
+struct KeyEvent
+{
+    std::chrono::steady_clock::time_point at;
+    uint16_t keys;
+};
+
+// If it ever fills, events are dropped; since each carries the whole
+// keypad, the next one that fits restores the right state.
+using KeyEventQueue = SpscRing<KeyEvent, 256>;
+
+// Paces the core against the host clock. Every host frame runs
+// cpuHz / FRAME_RATE cycles (carrying the fractional part over), or as many
+// cycles as fit before the frame deadline when cpuHz is 0 (unlimited), and
+// then ticks the 60 Hz timers once.
+// Deadlines are derived from the frame count rather than accumulated sleeps,
+// so sleep overshoot does not drift the emulated clock.
+class FrameScheduler
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit FrameScheduler(int cpuHz) : cpuHz(cpuHz)
+    {
+        resync();
+    }
+
+    template <typename Core>
+    void runFrame(Core &chip8);
+    template <typename Core, typename OnInput>
+    void runFramePaced(Core &chip8, KeyEventQueue &input, WakeSignal &wake, OnInput onInput);
+    template <typename Core, typename OnInput>
+    void applyInput(Core &chip8, KeyEventQueue &input, OnInput onInput);
+    template <typename Core>
+    void runTurbo(Core &chip8, int frameskip);
+    void waitForNextFrame();
+    template <typename Core>
+    void sleepIdle(Core &chip8, unsigned frames, WakeSignal &wake, uint64_t seen);
+    int cyclesForFrame();
+
+    bool unlimited() const
+    {
+        return cpuHz == 0;
+    }
+
+    // Instructions run through this scheduler so far
+    unsigned long long cyclesRun() const
+    {
+        return executed;
+    }
+
+    // Emulated frames (timer ticks) so far
+    unsigned long long framesRun() const
+    {
+        return ticked;
+    }
+
+    // Frame waits so far, and how far past their deadline they woke in total
+    unsigned long long framesSlept() const
+    {
+        return slept;
+    }
+
+    Clock::duration oversleep() const
+    {
+        return overshoot;
+    }
+
+    void resync()
+    {
+        epoch = Clock::now();
+        frameCount = 0;
+    }
+
+private:
+    int cpuHz;
+    int cycleRemainder = 0;
+    unsigned long long executed = 0;
+    unsigned long long ticked = 0;
+    unsigned long long slept = 0;
+    Clock::duration overshoot{};
+    Clock::time_point epoch;
+    long long frameCount = 0;
+
+    Clock::time_point frameStart(long long frame) const
+    {
+        return epoch + std::chrono::nanoseconds(frame * 1000000000LL / FRAME_RATE);
+    }
+
+    Clock::time_point frameDeadline() const
+    {
+        return frameStart(frameCount + 1);
+    }
+
+    template <typename Core>
+    void runCycles(Core &chip8, int cycles)
+    {
+        chip8.run(cycles);
+        executed += cycles;
+    }
+
+    template <typename Core>
+    void tick(Core &chip8)
+    {
+        chip8.tickTimers();
+        ++ticked;
+    }
+};
+
+template <typename Core>
+void FrameScheduler::runFrame(Core &chip8)
+{
+    if (unlimited())
+    {
+        const Clock::time_point deadline = frameDeadline();
+        // A waiting core would only spin until the deadline
+        do
+        {
+            chip8.run(UNLIMITED_BATCH);
+            executed += UNLIMITED_BATCH;
+        } while (Clock::now() < deadline && chip8.waitState() == Core::WaitState::None);
+    }
+    else
+    {
+        const int cycles = cyclesForFrame();
+        chip8.run(cycles);
+        executed += cycles;
+    }
+
+    tick(chip8);
+}
+
+// Like runFrame(), but spreads the frame's cycles over its wall-clock
+// period in INPUT_SLICES steps, sleeping on `wake` in between, and applies
+// each queued key event at the cycle its timestamp falls on. A key pressed
+// mid-frame is therefore seen by Ex9E/ExA1/Fx0A within a slice (~2 ms)
+// instead of at the next frame boundary. onInput(event) runs right after
+// each event is applied, with cyclesRun() at the cycle it landed on.
+template <typename Core, typename OnInput>
+void FrameScheduler::runFramePaced(Core &chip8, KeyEventQueue &input, WakeSignal &wake, OnInput onInput)
+{
+    KeyEvent event;
+    if (unlimited())
+    {
+        // A batch is already short, so events apply between batches
+        const Clock::time_point deadline = frameDeadline();
+        do
+        {
+            while (input.pop(event))
+            {
+                chip8.setKeypadMask(event.keys);
+                onInput(event);
+            }
+            runCycles(chip8, UNLIMITED_BATCH);
+        } while (Clock::now() < deadline && chip8.waitState() == Core::WaitState::None);
+        tick(chip8);
+        return;
+    }
+
+    const int cycles = cyclesForFrame();
+    const Clock::time_point start = frameStart(frameCount);
+    const Clock::duration period = frameDeadline() - start;
+    // Cycle of the frame that `t` falls on, clamped to [done, cycles]
+    auto cycleAt = [&](Clock::time_point t, int done) {
+        const long long at = t <= start ? 0 : (t - start).count() * cycles / period.count();
+        return static_cast<int>(std::min<long long>(std::max<long long>(at, done), cycles));
+    };
+
+    int done = 0;
+    while (true)
+    {
+        const uint64_t seen = wake.count();
+        while (input.pop(event))
+        {
+            const int at = cycleAt(event.at, done);
+            runCycles(chip8, at - done);
+            done = at;
+            chip8.setKeypadMask(event.keys);
+            onInput(event);
+        }
+        if (done == cycles)
+        {
+            break;
+        }
+
+        // Run one slice ahead of the host clock, then sleep until it
+        // catches up or a key event arrives
+        const int target = cycleAt(Clock::now() + period / INPUT_SLICES, done + 1);
+        runCycles(chip8, target - done);
+        done = target;
+        if (done == cycles)
+        {
+            break;
+        }
+        wake.waitUntil(seen, start + period * done / cycles);
+    }
+
+    tick(chip8);
+}
+
+// Applies every queued key event now, for when there is no frame timeline
+// to place them on (turbo, rewind)
+template <typename Core, typename OnInput>
+void FrameScheduler::applyInput(Core &chip8, KeyEventQueue &input, OnInput onInput)
+{
+    KeyEvent event;
+    while (input.pop(event))
+    {
+        chip8.setKeypadMask(event.keys);
+        onInput(event);
+    }
+}
+
+// Emulates whole frames back to back with no throttling, returning once
+// `frameskip` frames have run or, with frameskip 0, once a host frame's
+// worth of wall time has passed, so the caller presents at most 60 times a
+// second. Emulated frames keep their cpuHz / 60 cycles (the default rate
+// when unlimited) so game timing is the same as real time, just faster.
+template <typename Core>
+void FrameScheduler::runTurbo(Core &chip8, int frameskip)
+{
+    const Clock::time_point deadline = Clock::now() + std::chrono::nanoseconds(1000000000LL / FRAME_RATE);
+    int frames = 0;
+
+    do
+    {
+        const int cycles = cyclesForFrame();
+        chip8.run(cycles);
+        executed += cycles;
+        tick(chip8);
+        ++frames;
+    } while (frameskip > 0 ? frames < frameskip
+                           : (frames % TURBO_CLOCK_INTERVAL != 0 || Clock::now() < deadline));
+}
+
+// Cycles in the next emulated frame; unlimited schedulers use the default
+// rate here since their frames are otherwise timed by the wall clock.
+int FrameScheduler::cyclesForFrame()
+{
+    cycleRemainder += unlimited() ? DEFAULT_CPU_HZ : cpuHz;
+    const int cycles = cycleRemainder / FRAME_RATE;
+    cycleRemainder %= FRAME_RATE;
+    return cycles;
+}
+
+// Stands in for waitForNextFrame() while the core is in a wait state that
+// lasts `frames` more frames (Chip8::idleFrames). Blocks until `wake` moves
+// past `seen` (input arrived) or the wait would end, then runs the frames
+// that fell due meanwhile, which are cheap since run() skips wait loops,
+// so timers read as if the core had been spinning all along.
+template <typename Core>
+void FrameScheduler::sleepIdle(Core &chip8, unsigned frames, WakeSignal &wake, uint64_t seen)
+{
+    ++frameCount;
+    if (frames == IDLE_UNTIL_INPUT)
+    {
+        // Nothing changes until a key does; start a fresh timeline after
+        wake.wait(seen);
+        resync();
+        return;
+    }
+
+    wake.waitUntil(seen, frameStart(frameCount + frames));
+    for (unsigned i = 0; i < frames && Clock::now() >= frameStart(frameCount); ++i)
+    {
+        runFrame(chip8);
+        ++frameCount;
+    }
+}
+
+void FrameScheduler::waitForNextFrame()
+{
+    const Clock::time_point deadline = frameDeadline();
+    const Clock::time_point now = Clock::now();
+    ++frameCount;
+
+    if (now < deadline)
+    {
+        std::this_thread::sleep_until(deadline);
+        overshoot += Clock::now() - deadline;
+        ++slept;
+    }
+    else if (now - deadline > std::chrono::nanoseconds(MAX_FRAME_LAG * 1000000000LL / FRAME_RATE))
+    {
+        // Too far behind (debugger, suspended window); don't try to catch up
+        resync();
+    }
+}
+
+const size_t BATCH_LANES = 16; // Lanes per Chip8Lanes group in --lockstep batches
+const int REGRESS_RUNS = 3;    // Timed runs per regression entry; the fastest counts
+const size_t REGRESS_LANES = 4; // Lockstep lanes each classic regression entry is checked on
+const unsigned long long REGRESS_LOCKSTEP_CYCLES = 1000000; // Longest lockstep check per entry
+const double DEFAULT_REGRESS_TOLERANCE = 20; // Percent below the MIPS baseline that still passes
+
+enum class MachineKind
+{
+    Classic,
+    SuperChip,
+    XoChip,
+};
+
+static const char *machineName(MachineKind machine)
+{
+    switch (machine)
+    {
+    case MachineKind::SuperChip:
+        return SuperChipMachine::NAME;
+    case MachineKind::XoChip:
+        return XoChipMachine::NAME;
+    default:
+        return ClassicMachine::NAME;
+    }
+}
+
+static bool parseMachine(const std::string &value, MachineKind &machine)
+{
+    for (MachineKind kind : {MachineKind::Classic, MachineKind::SuperChip, MachineKind::XoChip})
+    {
+        if (value == machineName(kind))
+        {
+            machine = kind;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Default runs a machine with its own quirk set
+enum class QuirkSet
+{
+    Default,
+    Legacy,
+    Vip,
+    SuperChip,
+    Octo,
+};
+
+static const char *quirkName(QuirkSet quirks)
+{
+    switch (quirks)
+    {
+    case QuirkSet::Legacy:
+        return LegacyQuirks::NAME;
+    case QuirkSet::Vip:
+        return VipQuirks::NAME;
+    case QuirkSet::SuperChip:
+        return SuperChipQuirks::NAME;
+    case QuirkSet::Octo:
+        return OctoQuirks::NAME;
+    default:
+        return "default";
+    }
+}
+
+static bool parseQuirks(const std::string &value, QuirkSet &quirks)
+{
+    for (QuirkSet set : {QuirkSet::Default, QuirkSet::Legacy, QuirkSet::Vip, QuirkSet::SuperChip, QuirkSet::Octo})
+    {
+        if (value == quirkName(set))
+        {
+            quirks = set;
+            return true;
+        }
+    }
+    return false;
+}
+
+struct Options
+{
+    std::string romPath;
+    MachineKind machine = MachineKind::Classic;
+    QuirkSet quirks = QuirkSet::Default;
+    bool machineGiven = false; // --machine / --quirks win over the quirk database
+    bool quirksGiven = false;
+    std::string quirkDbPath;
+    int cpuHz = DEFAULT_CPU_HZ;
+    bool headless = false;
+    bool analyze = false; // Print the ROM's control-flow analysis and exit
+    unsigned long long cycles = 0; // Headless cycle budget, 0 = no limit
+    unsigned long long frames = 0; // Headless frame budget, 0 = no limit
+    bool vsync = false;
+    bool bench = false;
+    bool turbo = false;
+    int frameskip = 0; // Turbo: present every nth frame, 0 = at most 60 presents/s
+    int rewindMb = DEFAULT_REWIND_MB; // 0 disables rewind
+    int rewindSpeed = 1;              // Snapshots stepped back per frame
+    int audioBuffer = DEFAULT_AUDIO_BUFFER; // Samples, 0 disables audio
+    bool reportLatency = false; // SDL: print input-to-present latency on exit
+    bool overlay = false;       // SDL: start with the metrics overlay shown
+    std::string metricsPath;    // SDL: append a JSON metrics line here every second, "-" = stderr
+    std::string batchPath;
+    std::string regressPath; // Regression manifest to check (or, with updateGolden, rewrite)
+    bool updateGolden = false;
+    double regressTolerance = DEFAULT_REGRESS_TOLERANCE;
+    std::string outputPath;
+    unsigned threads = 0; // Batch workers, 0 = one per hardware thread
+    bool lockstep = false; // Batch: run jobs sharing a ROM and budget as Chip8Lanes
+    uint64_t seed = DEFAULT_SEED;
+    std::string recordPath; // SDL: write keypad changes here
+    std::string replayPath; // Headless: apply this input log
+#ifdef CHIP8_PROFILE
+    std::string profilePath;       // Write the instruction profile report here
+    std::string profileStacksPath; // Write collapsed call stacks here
+#endif
+};
+
+static void printUsage(const char *program)
+{
+    std::cerr << "Usage: " << program << " <ROM file> [options]" << std::endl
+              << "  --machine <name>        classic (default), schip (SUPER-CHIP 1.1) or xochip" << std::endl
+              << "  --quirks <name>         legacy, vip, schip or octo opcode behaviour (default: the machine's own)" << std::endl
+              << "  --quirk-db <file>       Pick the machine and quirks by ROM hash from this file" << std::endl
+              << "  --cpu-hz <n|unlimited>  Instructions per second (default " << DEFAULT_CPU_HZ << ")" << std::endl
+              << "  --vsync                 Synchronize presents with the display refresh" << std::endl
+              << "  --turbo                 Start unthrottled (Tab toggles)" << std::endl
+              << "  --frameskip <n>         Turbo: present every nth frame instead of 60 per second" << std::endl
+              << "  --rewind-mb <n>         Memory for rewind history, 0 disables (default " << DEFAULT_REWIND_MB << ")" << std::endl
+              << "  --rewind-speed <n>      Frames stepped back per frame while Backspace is held (default 1)" << std::endl
+              << "  --audio-buffer <n>      Audio buffer in samples, a power of two; 0 mutes (default " << DEFAULT_AUDIO_BUFFER << ")" << std::endl
+              << "  --latency               Report key-event-to-present latency on exit" << std::endl
+              << "  --overlay               Show emulation and render metrics on screen (F1 toggles)" << std::endl
+              << "  --metrics <file|->      Write a JSON metrics line every second (- = stderr)" << std::endl
+              << "  --seed <n>              Seed for the Cxkk random number generator" << std::endl
+              << "  --record <file>         Log keypad changes by cycle for --replay" << std::endl
+#ifdef CHIP8_PROFILE
+              << "  --profile <file>        Write an opcode and hot-address profile on exit" << std::endl
+              << "  --profile-stacks <file> Write collapsed call stacks (flamegraph input) on exit" << std::endl
+#endif
+              << "  --analyze               Print the ROM's code/data map, blocks and loops without running it" << std::endl
+              << "  --headless              Run without SDL and dump the final state" << std::endl
+              << "  --replay <file>         Headless: apply a recorded input log, by default to its end" << std::endl
+              << "  --cycles <n>            Headless: stop after n instructions" << std::endl
+              << "  --frames <n>            Headless: stop after n 60 Hz frames" << std::endl
+              << "  --bench                 Time synthetic instruction mixes (and the ROM, if given)" << std::endl
+              << "  --batch <job file>      Run many ROMs headless in parallel" << std::endl
+              << "  --threads <n>           Batch: worker threads (default: all cores)" << std::endl
+              << "  --output <file>         Batch: write results here instead of stdout" << std::endl
+              << "  --lockstep              Batch: run jobs with the same ROM and cycles " << BATCH_LANES << " at a time in lockstep" << std::endl
+              << "  --regress <manifest>    Check ROMs against golden state hashes and MIPS baselines" << std::endl
+              << "  --update-golden         Regress: record the measured hashes and MIPS in the manifest instead" << std::endl
+              << "  --tolerance <percent>   Regress: allowed MIPS drop below the baseline (default " << DEFAULT_REGRESS_TOLERANCE << ", 100 = hashes only)" << std::endl;
+}
+
+static bool parseCount(const char *name, const std::string &value, unsigned long long &out)
+{
+    char *end = nullptr;
+    const unsigned long long count = std::strtoull(value.c_str(), &end, 10);
+    if (value.empty() || *end != '\0' || count == 0)
+    {
+        std::cerr << "Invalid " << name << " value: " << value << std::endl;
+        return false;
+    }
+    out = count;
+    return true;
+}
+
+static bool parseOptions(int argc, char *argv[], Options &options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--machine" && i + 1 < argc)
+        {
+            const std::string value = argv[++i];
+            if (!parseMachine(value, options.machine))
+            {
+                std::cerr << "Unknown --machine: " << value << std::endl;
+                return false;
+            }
+            options.machineGiven = true;
+        }
+        else if (arg == "--quirks" && i + 1 < argc)
+        {
+            const std::string value = argv[++i];
+            if (!parseQuirks(value, options.quirks))
+            {
+                std::cerr << "Unknown --quirks: " << value << std::endl;
+                return false;
+            }
+            options.quirksGiven = true;
+        }
+        else if (arg == "--quirk-db" && i + 1 < argc)
+        {
+            options.quirkDbPath = argv[++i];
+        }
+        else if (arg == "--cpu-hz" && i + 1 < argc)
+        {
+            const std::string value = argv[++i];
+            unsigned long long hz = 0;
+            if (value == "unlimited")
+            {
+                options.cpuHz = 0;
+            }
+            else if (parseCount("--cpu-hz", value, hz))
+            {
+                options.cpuHz = static_cast<int>(hz);
+            }
+            else
+            {
+                return false;
+            }
+        }
+        else if (arg == "--vsync")
+        {
+            options.vsync = true;
+        }
+        else if (arg == "--latency")
+        {
+            options.reportLatency = true;
+        }
+        else if (arg == "--overlay")
+        {
+            options.overlay = true;
+        }
+        else if (arg == "--metrics" && i + 1 < argc)
+        {
+            options.metricsPath = argv[++i];
+        }
+        else if (arg == "--turbo")
+        {
+            options.turbo = true;
+        }
+        else if (arg == "--frameskip" && i + 1 < argc)
+        {
+            unsigned long long frameskip = 0;
+            if (!parseCount("--frameskip", argv[++i], frameskip))
+            {
+                return false;
+            }
+            options.frameskip = static_cast<int>(frameskip);
+        }
+        else if (arg == "--rewind-mb" && i + 1 < argc)
+        {
+            const std::string value = argv[++i];
+            unsigned long long mb = 0;
+            if (value != "0" && !parseCount("--rewind-mb", value, mb))
+            {
+                return false;
+            }
+            options.rewindMb = static_cast<int>(mb);
+        }
+        else if (arg == "--audio-buffer" && i + 1 < argc)
+        {
+            const std::string value = argv[++i];
+            unsigned long long samples = 0;
+            if (value != "0" && (!parseCount("--audio-buffer", value, samples) || samples > 32768 ||
+                                 (samples & (samples - 1)) != 0))
+            {
+                std::cerr << "--audio-buffer must be 0 or a power of two up to 32768" << std::endl;
+                return false;
+            }
+            options.audioBuffer = static_cast<int>(samples);
+        }
+        else if (arg == "--rewind-speed" && i + 1 < argc)
+        {
+            unsigned long long speed = 0;
+            if (!parseCount("--rewind-speed", argv[++i], speed))
+            {
+                return false;
+            }
+            options.rewindSpeed = static_cast<int>(speed);
+        }
+        else if (arg == "--seed" && i + 1 < argc)
+        {
+            const std::string value = argv[++i];
+            char *end = nullptr;
+            options.seed = std::strtoull(value.c_str(), &end, 0);
+            if (value.empty() || *end != '\0')
+            {
+                std::cerr << "Invalid --seed value: " << value << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--headless")
+        {
+            options.headless = true;
+        }
+        else if (arg == "--analyze")
+        {
+            options.analyze = true;
+        }
+        else if (arg == "--bench")
+        {
+            options.bench = true;
+        }
+        else if (arg == "--batch" && i + 1 < argc)
+        {
+            options.batchPath = argv[++i];
+        }
+        else if (arg == "--regress" && i + 1 < argc)
+        {
+            options.regressPath = argv[++i];
+        }
+        else if (arg == "--update-golden")
+        {
+            options.updateGolden = true;
+        }
+        else if (arg == "--tolerance" && i + 1 < argc)
+        {
+            const std::string value = argv[++i];
+            char *end = nullptr;
+            options.regressTolerance = std::strtod(value.c_str(), &end);
+            if (value.empty() || *end != '\0' || options.regressTolerance < 0 || options.regressTolerance > 100)
+            {
+                std::cerr << "Invalid --tolerance value: " << value << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--record" && i + 1 < argc)
+        {
+            options.recordPath = argv[++i];
+        }
+        else if (arg == "--replay" && i + 1 < argc)
+        {
+            options.replayPath = argv[++i];
+            options.headless = true;
+        }
+#ifdef CHIP8_PROFILE
+        else if (arg == "--profile" && i + 1 < argc)
+        {
+            options.profilePath = argv[++i];
+        }
+        else if (arg == "--profile-stacks" && i + 1 < argc)
+        {
+            options.profileStacksPath = argv[++i];
+        }
+#endif
+        else if (arg == "--lockstep")
+        {
+            options.lockstep = true;
+        }
+        else if (arg == "--output" && i + 1 < argc)
+        {
+            options.outputPath = argv[++i];
+        }
+        else if (arg == "--threads" && i + 1 < argc)
+        {
+            unsigned long long threads = 0;
+            if (!parseCount("--threads", argv[++i], threads))
+            {
+                return false;
+            }
+            options.threads = static_cast<unsigned>(threads);
+        }
+        else if (arg == "--cycles" && i + 1 < argc)
+        {
+            if (!parseCount("--cycles", argv[++i], options.cycles))
+            {
+                return false;
+            }
+        }
+        else if (arg == "--frames" && i + 1 < argc)
+        {
+            if (!parseCount("--frames", argv[++i], options.frames))
+            {
+                return false;
+            }
+        }
+        else if (arg.compare(0, 2, "--") != 0 && options.romPath.empty())
+        {
+            options.romPath = arg;
+        }
+        else
+        {
+            std::cerr << "Unknown argument: " << arg << std::endl;
+            return false;
+        }
+    }
+    return options.bench || !options.batchPath.empty() || !options.regressPath.empty() || !options.romPath.empty();
+}
+
+// Hash identifying a ROM in the quirk database: FNV-1a over the file
+static uint64_t romHash(const RomImage &rom)
+{
+    StateHash hash;
+    for (size_t i = 0; i < rom.size(); ++i)
+    {
+        hash.mix(rom.data()[i], 1);
+    }
+    return hash.value();
+}
+
+// Looks the ROM up in options.quirkDbPath, whose lines are
+// "<hex ROM hash> <machine> [quirks]", and takes its machine and quirks
+// unless the command line named them.
+static bool applyQuirkDatabase(Options &options)
+{
+    if (options.quirkDbPath.empty())
+    {
+        return true;
+    }
+
+    std::ifstream file(options.quirkDbPath);
+    if (!file.is_open())
+    {
+        std::cerr << "Failed to open quirk database: " << options.quirkDbPath << std::endl;
+        return false;
+    }
+    const std::shared_ptr<const RomImage> rom = RomImage::open(options.romPath);
+    if (!rom)
+    {
+        return false;
+    }
+    const uint64_t hash = romHash(*rom);
+
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(file, line))
+    {
+        ++lineNumber;
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+
+        std::istringstream fields(line);
+        uint64_t entryHash = 0;
+        std::string machineField;
+        std::string quirksField;
+        MachineKind machine = MachineKind::Classic;
+        QuirkSet quirks = QuirkSet::Default;
+        if (!(fields >> std::hex >> entryHash >> machineField) || !parseMachine(machineField, machine) ||
+            ((fields >> quirksField) && !parseQuirks(quirksField, quirks)))
+        {
+            std::cerr << options.quirkDbPath << ":" << lineNumber << ": bad quirk database entry" << std::endl;
+            return false;
+        }
+        if (entryHash == hash)
+        {
+            if (!options.machineGiven)
+            {
+                options.machine = machine;
+            }
+            if (!options.quirksGiven)
+            {
+                options.quirks = quirks;
+            }
+            return true;
+        }
+    }
+
+    const std::ios::fmtflags flags = std::cerr.flags();
+    std::cerr << "No quirk database entry for ROM hash " << std::hex << std::setw(16) << std::setfill('0') << hash
+              << "; running as " << machineName(options.machine) << std::endl;
+    std::cerr.flags(flags);
+    return true;
+}
+
+// Calls run with a default-constructed machine profile: `Base`, or `Base`
+// specialized on `quirks` when that differs from its own set. Every
+// combination is its own instantiation of the core.
+template <typename Base, typename Run>
+static int withQuirks(QuirkSet quirks, Run run)
+{
+    const auto as = [&](auto set) {
+        using Set = decltype(set);
+        if constexpr (std::is_same_v<Set, typename Base::Quirks>)
+        {
+            return run(Base{});
+        }
+        else
+        {
+            return run(WithQuirks<Base, Set>{});
+        }
+    };
+    switch (quirks)
+    {
+    case QuirkSet::Legacy:
+        return as(LegacyQuirks{});
+    case QuirkSet::Vip:
+        return as(VipQuirks{});
+    case QuirkSet::SuperChip:
+        return as(SuperChipQuirks{});
+    case QuirkSet::Octo:
+        return as(OctoQuirks{});
+    default:
+        return run(Base{});
+    }
+}
+
+template <typename Run>
+static int withMachine(const Options &options, Run run)
+{
+    switch (options.machine)
+    {
+    case MachineKind::SuperChip:
+        return withQuirks<SuperChipMachine>(options.quirks, run);
+    case MachineKind::XoChip:
+        return withQuirks<XoChipMachine>(options.quirks, run);
+    default:
+        return withQuirks<ClassicMachine>(options.quirks, run);
+    }
+}
+
+#ifndef CHIP8_HEADLESS
+template <typename Core>
+static bool writeStateFile(const std::string &path, const Core &chip8)
+{
+    const std::vector<uint8_t> state = chip8.saveState();
+    std::ofstream file(path, std::ios::binary);
+    if (!file.write(reinterpret_cast<const char *>(state.data()), state.size()))
+    {
+        std::cerr << "Failed to write save state: " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+template <typename Core>
+static bool readStateFile(const std::string &path, Core &chip8)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open())
+    {
+        std::cerr << "Failed to open save state: " << path << std::endl;
+        return false;
+    }
+    const std::vector<uint8_t> state((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    return chip8.loadState(state);
+}
+#endif
+
+// Keypad changes keyed by instruction count: before instruction `cycle`
+// executes, the keypad becomes `mask` (bit n = key n).
+struct InputEvent
+{
+    unsigned long long cycle;
+    uint16_t mask;
+};
+using InputScript = std::vector<InputEvent>;
+
+// One event per line: "<cycle> <hex mask>", in increasing cycle order.
+// Blank lines and lines starting with '#' are ignored.
+static bool loadInputScript(const std::string &path, InputScript &script)
+{
+    std::ifstream file(path);
+    if (!file.is_open())
+    {
+        std::cerr << "Failed to open input script: " << path << std::endl;
+        return false;
+    }
+
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(file, line))
+    {
+        ++lineNumber;
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+
+        std::istringstream fields(line);
+        InputEvent event{};
+        unsigned int mask = 0;
+        if (!(fields >> event.cycle >> std::hex >> mask) || mask > 0xFFFF ||
+            (!script.empty() && event.cycle < script.back().cycle))
+        {
+            std::cerr << path << ":" << lineNumber << ": bad input event" << std::endl;
+            return false;
+        }
+        event.mask = static_cast<uint16_t>(mask);
+        script.push_back(event);
+    }
+    return true;
+}
+
+#ifndef CHIP8_HEADLESS
+// Writes keypad changes in the input script format as they happen, so a
+// session can be replayed headless. Cycles count from the first frame;
+// the last line repeats the final mask at the cycle recording stopped, which
+// is where --replay ends by default. Lines are flushed as written so the
+// log survives a crash.
+class InputRecorder
+{
+public:
+    bool open(const std::string &path, const Options &options)
+    {
+        file.open(path);
+        if (!file.is_open())
+        {
+            std::cerr << "Failed to open input log: " << path << std::endl;
+            return false;
+        }
+        file << "# " << options.romPath << " --machine " << machineName(options.machine) << " --quirks "
+             << quirkName(options.quirks) << " --cpu-hz " << options.cpuHz << " --seed " << options.seed << std::endl;
+        return true;
+    }
+
+    void update(unsigned long long cycle, uint16_t mask)
+    {
+        if (file.is_open() && mask != lastMask)
+        {
+            write(cycle, mask);
+        }
+    }
+
+    void close(unsigned long long cycle)
+    {
+        if (file.is_open())
+        {
+            write(cycle, lastMask);
+            file.close();
+        }
+    }
+
+private:
+    std::ofstream file;
+    uint16_t lastMask = 0;
+
+    void write(unsigned long long cycle, uint16_t mask)
+    {
+        file << cycle << ' ' << std::hex << mask << std::dec << std::endl;
+        lastMask = mask;
+    }
+};
+#endif
+
+// Runs the core unthrottled until the cycle or frame budget in options is
+// spent, ticking the timers after every emulated frame of cpuHz / 60
+// cycles and applying `input` at its exact cycles. Returns the number of
+// instructions executed.
+template <typename Core>
+static unsigned long long runBudget(Core &chip8, const Options &options, unsigned long long &frames,
+                                    const InputScript *input = nullptr)
+{
+    FrameScheduler scheduler(options.cpuHz);
+    unsigned long long executed = 0;
+    size_t nextEvent = 0;
+    frames = 0;
+
+    while ((options.cycles == 0 || executed < options.cycles) && (options.frames == 0 || frames < options.frames))
+    {
+        unsigned long long cycles = scheduler.cyclesForFrame();
+        if (options.cycles != 0 && cycles > options.cycles - executed)
+        {
+            cycles = options.cycles - executed;
+        }
+
+        const unsigned long long frameEnd = executed + cycles;
+        while (input && nextEvent < input->size() && (*input)[nextEvent].cycle < frameEnd)
+        {
+            const InputEvent &event = (*input)[nextEvent++];
+            if (event.cycle > executed)
+            {
+                chip8.run(event.cycle - executed);
+                executed = event.cycle;
+            }
+            chip8.setKeypadMask(event.mask);
+        }
+
+        chip8.run(frameEnd - executed);
+        executed = frameEnd;
+        ++frames;
+        chip8.tickTimers();
+    }
+
+    return executed;
+}
+
+// runBudget for a lane set: same frame spacing and timer ticks, with lane
+// l following inputs[l] (null for no input). Events from different lanes
+// that fall on the same cycle are applied together.
+template <size_t Lanes>
+static unsigned long long runLanesBudget(Chip8Lanes<Lanes> &lanes, const Options &options, unsigned long long &frames,
+                                         const std::array<const InputScript *, Lanes> &inputs = {})
+{
+    FrameScheduler scheduler(options.cpuHz);
+    unsigned long long executed = 0;
+    std::array<size_t, Lanes> nextEvent{};
+    frames = 0;
+
+    while ((options.cycles == 0 || executed < options.cycles) && (options.frames == 0 || frames < options.frames))
+    {
+        unsigned long long cycles = scheduler.cyclesForFrame();
+        if (options.cycles != 0 && cycles > options.cycles - executed)
+        {
+            cycles = options.cycles - executed;
+        }
+
+        const unsigned long long frameEnd = executed + cycles;
+        for (;;)
+        {
+            unsigned long long eventCycle = frameEnd;
+            for (size_t l = 0; l < Lanes; ++l)
+            {
+                if (inputs[l] && nextEvent[l] < inputs[l]->size())
+                {
+                    eventCycle = std::min(eventCycle, (*inputs[l])[nextEvent[l]].cycle);
+                }
+            }
+            if (eventCycle >= frameEnd)
+            {
+                break;
+            }
+
+            if (eventCycle > executed)
+            {
+                lanes.run(eventCycle - executed);
+                executed = eventCycle;
+            }
+            for (size_t l = 0; l < Lanes; ++l)
+            {
+                while (inputs[l] && nextEvent[l] < inputs[l]->size() && (*inputs[l])[nextEvent[l]].cycle <= eventCycle)
+                {
+                    lanes.setKeypadMask(l, (*inputs[l])[nextEvent[l]++].mask);
+                }
+            }
+        }
+
+        lanes.run(frameEnd - executed);
+        executed = frameEnd;
+        ++frames;
+        lanes.tickTimers();
+    }
+
+    return executed;
+}
+
+#ifdef CHIP8_PROFILE
+// Attaches a profile to `chip8` if the options ask for one
+template <typename Core>
+static std::unique_ptr<InstructionProfile> attachProfile(const Options &options, Core &chip8)
+{
+    if (options.profilePath.empty() && options.profileStacksPath.empty())
+    {
+        return nullptr;
+    }
+    auto profile = std::make_unique<InstructionProfile>();
+    chip8.setProfile(profile.get());
+    return profile;
+}
+
+static bool writeProfile(const Options &options, const InstructionProfile *profile)
+{
+    if (!profile)
+    {
+        return true;
+    }
+    if (!options.profilePath.empty())
+    {
+        std::ofstream out(options.profilePath);
+        if (!out)
+        {
+            std::cerr << "Failed to open profile output: " << options.profilePath << std::endl;
+            return false;
+        }
+        profile->writeReport(out);
+    }
+    if (!options.profileStacksPath.empty())
+    {
+        std::ofstream out(options.profileStacksPath);
+        if (!out)
+        {
+            std::cerr << "Failed to open profile output: " << options.profileStacksPath << std::endl;
+            return false;
+        }
+        profile->writeCollapsedStacks(out);
+    }
+    return true;
+}
+#endif
+
+// Runs the core as fast as possible with no SDL initialization and prints
+// the final machine state. Timers still tick once per emulated frame
+// (cpuHz / 60 cycles) so timing-dependent ROMs behave as they would live.
+template <typename Machine>
+static int runHeadless(const Options &options)
+{
+    InputScript input;
+    if (!options.replayPath.empty() && !loadInputScript(options.replayPath, input))
+    {
+        return 1;
+    }
+
+    Options budget = options;
+    if (budget.cycles == 0 && budget.frames == 0 && !input.empty())
+    {
+        budget.cycles = input.back().cycle;
+    }
+    if (budget.cycles == 0 && budget.frames == 0)
+    {
+        std::cerr << "Headless mode needs --cycles, --frames or a non-empty --replay log" << std::endl;
+        return 1;
+    }
+
+    // Heap-allocated: an XO-CHIP core is too big for the stack
+    const auto core = std::make_unique<BasicChip8<Machine>>(options.seed);
+    BasicChip8<Machine> &chip8 = *core;
+    if (!chip8.loadROM(options.romPath))
+    {
+        return 1;
+    }
+
+#ifdef CHIP8_PROFILE
+    const std::unique_ptr<InstructionProfile> profile = attachProfile(options, chip8);
+#endif
+
+    unsigned long long frames = 0;
+    const unsigned long long executed = runBudget(chip8, budget, frames, &input);
+
+    std::cout << "Cycles=" << executed << " Frames=" << frames << std::endl;
+    chip8.dumpState(std::cout);
+#ifdef CHIP8_PROFILE
+    if (!writeProfile(options, profile.get()))
+    {
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+template <typename Machine>
+static int runAnalyze(const Options &options)
+{
+    const std::shared_ptr<const RomImage> rom = RomImage::open(options.romPath);
+    const auto core = std::make_unique<BasicChip8<Machine>>();
+    BasicChip8<Machine> &chip8 = *core;
+    if (!rom || !chip8.loadROM(*rom))
+    {
+        return 1;
+    }
+    chip8.analyze(rom->size()).write(std::cout);
+    return 0;
+}
+
+struct BenchProgram
+{
+    const char *name;
+    std::vector<uint8_t> code;
+};
+
+// Tight loops, each dominated by one class of instruction
+static const BenchProgram BENCH_PROGRAMS[] = {
+    {"alu 8xyN", {0x60, 0x01, 0x61, 0x02, 0x80, 0x14, 0x81, 0x05, 0x80, 0x13, 0x81, 0x26, 0x80, 0x1E,
+                  0x82, 0x04, 0x83, 0x15, 0x84, 0x23, 0x85, 0x32, 0x86, 0x47, 0x87, 0x51, 0x12, 0x04}},
+    {"sprite Dxyn", {0xA0, 0x50, 0x60, 0x00, 0x61, 0x00, 0xD0, 0x15, 0x70, 0x05, 0xD0, 0x1F, 0x71, 0x03,
+                     0xD0, 0x18, 0x70, 0x3B, 0xD0, 0x15, 0x12, 0x06}},
+    {"memory Fx55/Fx65", {0xA4, 0x00, 0xFF, 0x55, 0xFF, 0x65, 0xF7, 0x55, 0xF7, 0x65, 0x12, 0x02}},
+    {"branch 3xkk/4xkk", {0x60, 0x00, 0x61, 0x01, 0x30, 0x00, 0x00, 0x00, 0x41, 0x00, 0x00, 0x00,
+                          0x30, 0x01, 0x70, 0x00, 0x41, 0x01, 0x71, 0x00, 0x50, 0x10, 0x12, 0x04}},
+};
+
+const unsigned long long DEFAULT_BENCH_CYCLES = 50000000;
+
+static void benchmark(const char *name, Chip8 &chip8, const Options &options)
+{
+    Options budget = options;
+    budget.cycles = options.cycles != 0 ? options.cycles : DEFAULT_BENCH_CYCLES;
+    budget.frames = 0;
+
+    unsigned long long frames = 0;
+    const auto start = std::chrono::steady_clock::now();
+    const unsigned long long executed = runBudget(chip8, budget, frames);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << std::left << std::setw(20) << name << std::right
+              << std::setw(12) << executed
+              << std::fixed << std::setprecision(3) << std::setw(10) << seconds
+              << std::setprecision(1) << std::setw(10) << executed / seconds / 1e6
+              << std::setprecision(2) << std::setw(10) << seconds * 1e9 / executed << std::endl;
+}
+
+// Same as benchmark() for `Lanes` copies of `boot` in lockstep. The cycle
+// column and MIPS count instructions summed over all lanes.
+template <size_t Lanes>
+static void benchmarkLanes(const std::string &name, const Chip8 &boot, const Options &options)
+{
+    Options budget = options;
+    budget.cycles = (options.cycles != 0 ? options.cycles : DEFAULT_BENCH_CYCLES) / Lanes;
+    budget.frames = 0;
+
+    Chip8Lanes<Lanes> lanes(boot);
+    unsigned long long frames = 0;
+    const auto start = std::chrono::steady_clock::now();
+    const unsigned long long executed = runLanesBudget(lanes, budget, frames) * Lanes;
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << std::left << std::setw(20) << name + " x" + std::to_string(Lanes) << std::right
+              << std::setw(12) << executed
+              << std::fixed << std::setprecision(3) << std::setw(10) << seconds
+              << std::setprecision(1) << std::setw(10) << executed / seconds / 1e6
+              << std::setprecision(2) << std::setw(10) << seconds * 1e9 / executed << std::endl;
+}
+
+// Reports throughput of the interpreter hot paths. Each program runs in a
+// fresh Chip8 for the --cycles budget, with timers ticked at the --cpu-hz
+// frame spacing as in headless mode, then again as 8 and 16 lockstep lanes
+// sharing the same total instruction budget.
+static int runBench(const Options &options)
+{
+    std::cout << std::left << std::setw(20) << "benchmark" << std::right << std::setw(12) << "cycles"
+              << std::setw(10) << "seconds" << std::setw(10) << "MIPS" << std::setw(10) << "ns/instr" << std::endl;
+
+    for (const BenchProgram &program : BENCH_PROGRAMS)
+    {
+        Chip8 chip8(options.seed);
+        chip8.loadProgram(program.code.data(), program.code.size());
+        benchmark(program.name, chip8, options);
+    }
+
+    for (const BenchProgram &program : BENCH_PROGRAMS)
+    {
+        Chip8 boot(options.seed);
+        boot.loadProgram(program.code.data(), program.code.size());
+        benchmarkLanes<8>(program.name, boot, options);
+        benchmarkLanes<16>(program.name, boot, options);
+    }
+
+    if (!options.romPath.empty())
+    {
+        Chip8 chip8(options.seed);
+        if (!chip8.loadROM(options.romPath))
+        {
+            return 1;
+        }
+        benchmark(options.romPath.c_str(), chip8, options);
+    }
+
+    return 0;
+}
+
+struct BatchJob
+{
+    std::string romPath;
+    unsigned long long cycles;
+    std::string inputPath; // Optional
+};
+
+// Job file: one job per line, "<ROM file> <cycles> [input script]".
+// Blank lines and lines starting with '#' are ignored.
+static bool loadBatchJobs(const std::string &path, std::vector<BatchJob> &jobs)
+{
+    std::ifstream file(path);
+    if (!file.is_open())
+    {
+        std::cerr << "Failed to open job file: " << path << std::endl;
+        return false;
+    }
+
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(file, line))
+    {
+        ++lineNumber;
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+
+        std::istringstream fields(line);
+        BatchJob job{};
+        if (!(fields >> job.romPath >> job.cycles) || job.cycles == 0)
+        {
+            std::cerr << path << ":" << lineNumber << ": expected <ROM file> <cycles> [input script]" << std::endl;
+            return false;
+        }
+        fields >> job.inputPath;
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+// Returns false if the job could not be started; `line` is filled either way
+static bool runBatchJob(const BatchJob &job, const Options &options, RomCache &roms, std::string &line)
+{
+    const auto start = std::chrono::steady_clock::now();
+    std::ostringstream result;
+    result << job.romPath << ' ';
+
+    Chip8 chip8(options.seed);
+    InputScript input;
+    const std::shared_ptr<const RomImage> rom = roms.get(job.romPath);
+    if (!rom || !chip8.loadROM(*rom) || (!job.inputPath.empty() && !loadInputScript(job.inputPath, input)))
+    {
+        result << "error";
+        line = result.str();
+        return false;
+    }
+
+    Options budget = options;
+    budget.cycles = job.cycles;
+    budget.frames = 0;
+    unsigned long long frames = 0;
+    const unsigned long long executed = runBudget(chip8, budget, frames, &input);
+    const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    result << "cycles=" << executed << " frames=" << frames
+           << " hash=" << std::hex << std::setw(16) << std::setfill('0') << chip8.stateHash() << std::dec
+           << " ms=" << std::fixed << std::setprecision(2) << ms;
+    line = result.str();
+    return true;
+}
+
+// Runs up to Lanes jobs that share a ROM and cycle budget as one lane set.
+// Each lane gets the scalar job's seed and its own input script, so lines
+// match what runBatchJob would print apart from ms, which is the group's.
+template <size_t Lanes>
+static bool runBatchLanes(const std::vector<BatchJob> &jobs, const std::vector<size_t> &group, const Options &options,
+                          RomCache &roms, std::vector<std::string> &lines)
 {
-public:
-    Chip8()
+    const auto start = std::chrono::steady_clock::now();
+    const BatchJob &first = jobs[group.front()];
+
+    Chip8 boot(options.seed);
+    std::vector<InputScript> scripts(group.size());
+    std::array<const InputScript *, Lanes> inputs{};
+    const std::shared_ptr<const RomImage> rom = roms.get(first.romPath);
+    bool loaded = rom && boot.loadROM(*rom);
+    for (size_t l = 0; loaded && l < group.size(); ++l)
     {
-        memory.fill(0);
-        V.fill(0);
-        stack.fill(0);
-        display.fill(0);
-        keypad.fill(0);
+        const BatchJob &job = jobs[group[l]];
+        loaded = job.inputPath.empty() || loadInputScript(job.inputPath, scripts[l]);
+        inputs[l] = &scripts[l];
+    }
+    if (!loaded)
+    {
+        for (size_t job : group)
+        {
+            lines[job] = jobs[job].romPath + " error";
+        }
+        return false;
+    }
+
+    Chip8Lanes<Lanes> lanes(boot);
+    Options budget = options;
+    budget.cycles = first.cycles;
+    budget.frames = 0;
+    unsigned long long frames = 0;
+    const unsigned long long executed = runLanesBudget(lanes, budget, frames, inputs);
+    const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    for (size_t l = 0; l < group.size(); ++l)
+    {
+        std::ostringstream result;
+        result << jobs[group[l]].romPath << " cycles=" << executed << " frames=" << frames
+               << " hash=" << std::hex << std::setw(16) << std::setfill('0') << lanes.stateHash(l) << std::dec
+               << " ms=" << std::fixed << std::setprecision(2) << ms;
+        lines[group[l]] = result.str();
+    }
+    return true;
+}
 
-        // Load fontset
-        for (size_t i = 0; i < FONTSET_SIZE; ++i)
+// Splits jobs into groups of at most BATCH_LANES with equal ROM path and
+// cycle budget, in job-file order within each group
+static std::vector<std::vector<size_t>> groupLockstepJobs(const std::vector<BatchJob> &jobs)
+{
+    std::vector<std::vector<size_t>> groups;
+    std::map<std::pair<std::string, unsigned long long>, size_t> open; // Key -> group still filling
+    for (size_t job = 0; job < jobs.size(); ++job)
+    {
+        const auto key = std::make_pair(jobs[job].romPath, jobs[job].cycles);
+        auto it = open.find(key);
+        if (it == open.end() || groups[it->second].size() == BATCH_LANES)
         {
-            memory[0x50 + i] = fontset[i];
+            it = open.insert_or_assign(key, groups.size()).first;
+            groups.emplace_back();
         }
+        groups[it->second].push_back(job);
+    }
+    return groups;
+}
 
-        // Reset
-        delayTimer = 0;
-        soundTimer = 0;
-        pc = PROGRAM_START;
-        I = 0;
-        sp = 0;
+// Work-stealing pool: jobs are dealt round-robin into per-worker queues;
+// a worker takes from the back of its own queue and, once that is empty,
+// steals from the front of the others. Every job owns its Chip8, so
+// workers share nothing but the queues, the result slots and the
+// read-only ROM images.
+static void runParallel(size_t jobCount, unsigned threads, const std::function<void(size_t)> &work)
+{
+    struct WorkQueue
+    {
+        std::mutex mutex;
+        std::deque<size_t> jobs;
+    };
+    std::vector<WorkQueue> queues(threads);
+    for (size_t job = 0; job < jobCount; ++job)
+    {
+        queues[job % threads].jobs.push_back(job);
     }
 
-    void loadROM(const std::string &filename);
-    void emulateCycle();
-    void renderDisplay(SDL_Renderer *renderer);
-    void setKeyState(uint8_t key, bool pressed);
+    auto take = [&queues, threads](unsigned self, size_t &job) {
+        for (unsigned i = 0; i < threads; ++i)
+        {
+            WorkQueue &queue = queues[(self + i) % threads];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.jobs.empty())
+            {
+                if (i == 0)
+                {
+                    job = queue.jobs.back();
+                    queue.jobs.pop_back();
+                }
+                else
+                {
+                    job = queue.jobs.front();
+                    queue.jobs.pop_front();
+                }
+                return true;
+            }
+        }
+        return false;
+    };
 
-    bool shouldDraw() const
+    std::vector<std::thread> workers;
+    for (unsigned self = 0; self < threads; ++self)
+    {
+        workers.emplace_back([&take, &work, self]() {
+            size_t job = 0;
+            while (take(self, job))
+            {
+                work(job);
+            }
+        });
+    }
+    for (std::thread &worker : workers)
     {
-        return drawFlag;
+        worker.join();
     }
+}
 
-private:
-    // Components
-    std::array<uint8_t, MEMORY_SIZE> memory{};
-    std::array<uint8_t, REGISTER_COUNT> V{};
-    uint16_t I = 0;
-    uint16_t pc = PROGRAM_START;
-    std::array<uint16_t, STACK_SIZE> stack{};
-    uint16_t sp = 0; // Stack pointer
+// Runs every job in the job file headless and writes one result line per
+// job, in job-file order: "<ROM> cycles=<n> frames=<n> hash=<state hash> ms=<t>"
+static int runBatch(const Options &options)
+{
+    std::vector<BatchJob> jobs;
+    if (!loadBatchJobs(options.batchPath, jobs))
+    {
+        return 1;
+    }
 
-    std::array<uint8_t, DISPLAY_WIDTH * DISPLAY_HEIGHT> display{};
-    std::array<uint8_t, KEYPAD_SIZE> keypad{};
+    unsigned threads = options.threads != 0 ? options.threads : std::thread::hardware_concurrency();
+    threads = std::max(1u, std::min<unsigned>(threads, static_cast<unsigned>(std::max<size_t>(jobs.size(), 1))));
 
-    uint8_t delayTimer = 0;
-    uint8_t soundTimer = 0;
+    std::vector<std::string> results(jobs.size());
+    std::vector<char> succeeded(jobs.size()); // Not vector<bool>: workers write neighbouring slots
+    RomCache roms;
+    if (options.lockstep)
+    {
+        const std::vector<std::vector<size_t>> groups = groupLockstepJobs(jobs);
+        runParallel(groups.size(), threads, [&](size_t group) {
+            const bool ok = runBatchLanes<BATCH_LANES>(jobs, groups[group], options, roms, results);
+            for (size_t job : groups[group])
+            {
+                succeeded[job] = ok;
+            }
+        });
+    }
+    else
+    {
+        runParallel(jobs.size(), threads, [&](size_t job) {
+            succeeded[job] = runBatchJob(jobs[job], options, roms, results[job]);
+        });
+    }
 
-    bool drawFlag = false;
+    std::ofstream file;
+    if (!options.outputPath.empty())
+    {
+        file.open(options.outputPath);
+        if (!file.is_open())
+        {
+            std::cerr << "Failed to open output: " << options.outputPath << std::endl;
+            return 1;
+        }
+    }
+    std::ostream &out = options.outputPath.empty() ? std::cout : file;
 
-    const std::array<uint8_t, FONTSET_SIZE> fontset = {
-        0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
-        0x20, 0x60, 0x20, 0x20, 0x70, // 1
-        0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
-        0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
-        0x90, 0x90, 0xF0, 0x10, 0x10, // 4
-        0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
-        0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
-        0xF0, 0x10, 0x20, 0x40, 0x40, // 7
-        0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
-        0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
-        0xF0, 0x90, 0xF0, 0x90, 0x90, // A
-        0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
-        0xF0, 0x80, 0x80, 0x80, 0xF0, // C
-        0xE0, 0x90, 0x90, 0x90, 0xE0, // D
-        0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
-        0xF0, 0x80, 0xF0, 0x80, 0x80  // F
-    };
+    for (const std::string &result : results)
+    {
+        out << result << '\n';
+    }
+    return std::find(succeeded.begin(), succeeded.end(), 0) == succeeded.end() ? 0 : 1;
+}
 
-    uint16_t fetchOpcode();
-    void executeOpcode(uint16_t opcode);
+// One line of a regression manifest:
+//   <ROM file> <cycles> [hash=<hex>] [mips=<n>] [machine=<name>] [quirks=<name>]
+// hash is the stateHash() after running the ROM for <cycles> instructions
+// from a fresh machine, mips the baseline throughput. Either may be
+// missing until --update-golden records it.
+struct RegressEntry
+{
+    int lineNumber = 0;
+    std::string romPath;
+    unsigned long long cycles = 0;
+    bool hasHash = false;
+    uint64_t hash = 0;
+    // Only entries with a mips= field are timed; ROMs that park in a
+    // skipped wait would measure the skip, not the interpreter
+    bool timed = false;
+    double mips = 0; // 0 = no baseline yet
+    MachineKind machine = MachineKind::Classic;
+    QuirkSet quirks = QuirkSet::Default;
 };
 
-void Chip8::loadROM(const std::string &filename)
+static bool parseRegressEntry(const std::string &line, RegressEntry &entry)
 {
-    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    std::istringstream fields(line);
+    if (!(fields >> entry.romPath >> entry.cycles) || entry.cycles == 0)
+    {
+        return false;
+    }
+    std::string field;
+    while (fields >> field)
+    {
+        const size_t equals = field.find('=');
+        const std::string key = field.substr(0, equals);
+        const std::string value = equals == std::string::npos ? "" : field.substr(equals + 1);
+        char *end = nullptr;
+        if (key == "hash")
+        {
+            entry.hash = std::strtoull(value.c_str(), &end, 16);
+            entry.hasHash = true;
+        }
+        else if (key == "mips")
+        {
+            entry.mips = std::strtod(value.c_str(), &end);
+            entry.timed = true;
+        }
+        else if (key == "machine" && parseMachine(value, entry.machine))
+        {
+            continue;
+        }
+        else if (key == "quirks" && parseQuirks(value, entry.quirks))
+        {
+            continue;
+        }
+        else
+        {
+            return false;
+        }
+        if (value.empty() || *end != '\0')
+        {
+            return false;
+        }
+    }
+    return true;
+}
 
-    if (!file.is_open())
+// Runs the entry REGRESS_RUNS times from a freshly booted machine; every
+// run must end in the same state. The ROM is loaded once into a template.
+// Even runs cloneFrom() it (the first into a core with another boot image,
+// later ones over pages both have written) and odd runs reset(), so the
+// golden hash also covers both ways of restoring a machine.
+template <typename Machine>
+static bool runRegressEntry(const RegressEntry &entry, const Options &options, const RomImage &rom, uint64_t &hash,
+                            double &mips)
+{
+    Options budget = options;
+    budget.cycles = entry.cycles;
+    budget.frames = 0;
+    mips = 0;
+    const auto boot = std::make_unique<BasicChip8<Machine>>(options.seed);
+    if (!boot->loadROM(rom))
     {
-        std::cerr << "Failed to open ROM: " << filename << std::endl;
-        return;
+        return false;
     }
+    const auto core = std::make_unique<BasicChip8<Machine>>();
+    BasicChip8<Machine> &chip8 = *core;
+    for (int run = 0; run < REGRESS_RUNS; ++run)
+    {
+        if (run % 2 == 0)
+        {
+            chip8.cloneFrom(*boot);
+        }
+        else
+        {
+            chip8.reset();
+        }
+        unsigned long long frames = 0;
+        const auto start = std::chrono::steady_clock::now();
+        const unsigned long long executed = runBudget(chip8, budget, frames);
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-    std::streamsize size = file.tellg();
+        if (run > 0 && chip8.stateHash() != hash)
+        {
+            std::cerr << entry.romPath << ": runs disagree; a restore left state behind or the emulation is not deterministic" << std::endl;
+            return false;
+        }
+        hash = chip8.stateHash();
+        mips = std::max(mips, executed / std::max(seconds, 1e-9) / 1e6);
+    }
+    return true;
+}
 
-    if (size > MEMORY_SIZE) {
-        std::cerr << "ROM FILE size exceeded limits" << std::endl;
-        exit(1);
+// ROM paths in a manifest are relative to the manifest's directory, so a
+// checked-in corpus runs from anywhere
+static std::string regressRomPath(const std::string &manifestPath, const std::string &romPath)
+{
+    const size_t slash = manifestPath.find_last_of('/');
+    if (romPath[0] == '/' || slash == std::string::npos)
+    {
+        return romPath;
     }
+    return manifestPath.substr(0, slash + 1) + romPath;
+}
+
+// Runs a classic entry as REGRESS_LANES lockstep lanes, lane l seeded with
+// --seed + l so ROMs that use Cxkk diverge, and checks each lane against a
+// scalar core run from the same seed. Chip8Lanes implements every opcode
+// separately from the scalar handlers; this keeps the two in step. Long
+// throughput entries are only checked for their first
+// REGRESS_LOCKSTEP_CYCLES instructions.
+static bool checkLockstep(const RegressEntry &entry, const Options &options, const RomImage &rom)
+{
+    Options budget = options;
+    budget.cycles = std::min(entry.cycles, REGRESS_LOCKSTEP_CYCLES);
+    budget.frames = 0;
 
-    file.seekg(0, std::ios::beg);
+    Chip8 boot(options.seed);
+    if (!boot.loadROM(rom))
+    {
+        return false;
+    }
+    Chip8Lanes<REGRESS_LANES> lanes(boot);
+    for (size_t l = 0; l < REGRESS_LANES; ++l)
+    {
+        lanes.seedRandom(l, options.seed + l);
+    }
+    unsigned long long frames = 0;
+    runLanesBudget(lanes, budget, frames);
 
-    std::vector<char> buffer(size);
-    if (file.read(buffer.data(), size))
+    for (size_t l = 0; l < REGRESS_LANES; ++l)
     {
-        for (size_t i = 0; i < buffer.size(); ++i)
+        Chip8 chip8(options.seed + l);
+        if (!chip8.loadROM(rom))
+        {
+            return false;
+        }
+        runBudget(chip8, budget, frames);
+        if (chip8.stateHash() != lanes.stateHash(l))
         {
-            memory[PROGRAM_START + i] = buffer[i];
+            std::cerr << entry.romPath << ": lockstep lane " << l << " disagrees with the scalar core" << std::endl;
+            return false;
         }
     }
-
-    file.close();
+    return true;
 }
 
-uint16_t Chip8::fetchOpcode()
+static std::string formatRegressEntry(const RegressEntry &entry)
 {
-    return (memory[pc] << 8) | memory[pc + 1];
+    std::ostringstream line;
+    line << entry.romPath << ' ' << entry.cycles;
+    if (entry.hasHash)
+    {
+        line << " hash=" << std::hex << std::setw(16) << std::setfill('0') << entry.hash << std::dec;
+    }
+    if (entry.timed)
+    {
+        line << " mips=" << std::fixed << std::setprecision(1) << entry.mips;
+    }
+    if (entry.machine != MachineKind::Classic)
+    {
+        line << " machine=" << machineName(entry.machine);
+    }
+    if (entry.quirks != QuirkSet::Default)
+    {
+        line << " quirks=" << quirkName(entry.quirks);
+    }
+    return line.str();
 }
 
-void Chip8::executeOpcode(uint16_t opcode)
+// Checks every manifest entry against its golden hash and MIPS baseline,
+// printing one PASS/FAIL line each; fails when any hash differs or is
+// missing, or throughput falls more than --tolerance percent below the
+// baseline. With --update-golden the measured hashes, and the MIPS of
+// entries that have a mips= field (mips=0 asks for a first baseline), are
+// written back to the manifest instead, keeping its comments and order.
+static int runRegress(const Options &options)
 {
+    std::ifstream file(options.regressPath);
+    if (!file.is_open())
+    {
+        std::cerr << "Failed to open regression manifest: " << options.regressPath << std::endl;
+        return 1;
+    }
 
-    const int x = (opcode & 0x0F00) >> 8;
-    const int y = (opcode & 0x00F0) >> 4;
-    switch (opcode & 0xF000)
+    std::vector<std::string> lines;
+    std::vector<RegressEntry> entries;
+    std::string line;
+    while (std::getline(file, line))
     {
-    case 0x0000:
-        if (opcode == 0x00E0) // Clear Display
+        lines.push_back(line);
+        if (line.empty() || line[0] == '#')
         {
-            display.fill(0);
-            drawFlag = true;
-            pc += 2;
+            continue;
         }
-        else if (opcode == 0x00EE) // Return from a subroutine, like return to a parent functions of sorts
+        RegressEntry entry;
+        entry.lineNumber = static_cast<int>(lines.size());
+        if (!parseRegressEntry(line, entry))
         {
-            --sp;
-            pc = stack[sp];
-            pc += 2;
+            std::cerr << options.regressPath << ":" << entry.lineNumber
+                      << ": expected <ROM file> <cycles> [hash=<hex>] [mips=<n>] [machine=<name>] [quirks=<name>]"
+                      << std::endl;
+            return 1;
         }
-        break;
-    case 0x1000: // Jump to nnn in 1nnn
-        pc = opcode & 0x0FFF;
-        break;
-    case 0x2000: // 2nnn, current pc is put on top of stack and pc is set to nnn
-        stack[sp] = pc;
-        ++sp;
-        pc = opcode & 0x0FFF;
-        break;
-    case 0x3000: // 3xkk - if Vx=kk, then skip instruction
-        if (V[(opcode & 0x0F00) >> 8] == (opcode & 0x00FF))
+        entries.push_back(entry);
+    }
+    file.close();
+
+    RomCache roms;
+    int failures = 0;
+    for (RegressEntry &entry : entries)
+    {
+        const std::shared_ptr<const RomImage> rom = roms.get(regressRomPath(options.regressPath, entry.romPath));
+        Options machineOptions = options;
+        machineOptions.machine = entry.machine;
+        machineOptions.quirks = entry.quirks;
+        uint64_t hash = 0;
+        double mips = 0;
+        const bool ran = rom && withMachine(machineOptions, [&](auto machine) {
+                             return runRegressEntry<decltype(machine)>(entry, options, *rom, hash, mips) ? 1 : 0;
+                         }) != 0;
+        if (!ran)
         {
-            pc += 4;
+            std::cout << "FAIL " << entry.romPath << " error" << std::endl;
+            ++failures;
+            continue;
         }
-        else
+        const bool lockstep =
+            entry.machine == MachineKind::Classic && (entry.quirks == QuirkSet::Default || entry.quirks == QuirkSet::Legacy);
+        if (lockstep && !checkLockstep(entry, options, *rom))
         {
-            pc += 2;
+            std::cout << "FAIL " << entry.romPath << " lockstep" << std::endl;
+            ++failures;
+            continue;
         }
-        break;
-    case 0x4000: // 4xkk - skip instruction if Vx!=kk
-        if (V[(opcode & 0xF00) >> 8] == (opcode & 0x00FF))
+
+        if (options.updateGolden)
         {
-            pc += 2;
+            entry.hasHash = true;
+            entry.hash = hash;
+            if (entry.timed)
+            {
+                entry.mips = mips;
+            }
+            lines[entry.lineNumber - 1] = formatRegressEntry(entry);
+            std::cout << "UPDATE " << lines[entry.lineNumber - 1] << std::endl;
+            continue;
         }
-        else
+
+        const bool hashOk = entry.hasHash && hash == entry.hash;
+        const double floor = entry.mips * (1 - options.regressTolerance / 100);
+        const bool speedOk = entry.mips == 0 || mips >= floor;
+        std::cout << (hashOk && speedOk ? "PASS " : "FAIL ") << entry.romPath << " hash=" << std::hex << std::setw(16)
+                  << std::setfill('0') << hash << std::dec << (entry.hasHash ? (hashOk ? "" : " (golden differs)") : " (no golden)");
+        if (entry.timed)
         {
-            pc += 4;
+            std::cout << " mips=" << std::fixed << std::setprecision(1) << mips;
         }
-        break;
-    case 0x5000: // 5xy0 - skip if Vx=Vy
-        if (V[(opcode & 0x0F00) >> 8] == V[(opcode & 0x00F0) >> 4])
+        if (entry.mips > 0)
         {
-            pc += 4;
+            std::cout << " (baseline " << entry.mips << (speedOk ? ")" : ", too slow)");
         }
-        else
+        std::cout << std::endl;
+        failures += !(hashOk && speedOk);
+    }
+
+    if (options.updateGolden)
+    {
+        // Written beside the manifest and renamed over it, so a failed
+        // write never leaves it truncated
+        const std::string temporary = options.regressPath + ".tmp";
+        std::ofstream out(temporary);
+        for (const std::string &text : lines)
         {
-            pc += 2;
+            out << text << '\n';
         }
-        break;
-    case 0x6000: // 6xkk - set Vx to kk
-        V[(opcode & 0x0F00) >> 8] = opcode & 0x00FF;
-        pc += 2;
-        break;
-    case 0x7000: // 7xkk - add kk to Vx
-        V[(opcode & 0x0F00) >> 8] += opcode & 0x00FF;
-        pc += 2;
-        break;
-    case 0x8000:
-        switch (opcode & 0x000F)
+        out.close();
+        if (!out || std::rename(temporary.c_str(), options.regressPath.c_str()) != 0)
         {
-        case 0x0: // 8xy0 - Vx = Vy
-            V[x] = V[y];
-            pc += 2;
-            break;
-        case 0x1: // 8xy1 - OR Vx ,Vy
-            V[x] |= V[y];
-            pc += 2;
-            break;
+            std::cerr << "Failed to write regression manifest: " << options.regressPath << std::endl;
+            return 1;
+        }
+        return failures == 0 ? 0 : 1;
+    }
 
-        case 0x2: // 8xy2 - AND Vx ,Vy
-            V[x] &= V[y];
-            pc += 2;
-            break;
+    std::cout << entries.size() - failures << '/' << entries.size() << " passed" << std::endl;
+    return failures == 0 ? 0 : 1;
+}
 
-        case 0x3: // 8xy3 - XOR Vx, Vy
-            V[x] ^= V[y];
-            pc += 2;
-            break;
+// Lock-free handoff of the latest value from one writer thread to one
+// reader thread. The writer fills back() and publish()es it; the reader
+// acquire()s the newest published value into front(). Neither side waits,
+// the reader always sees a whole value, and values the reader never got
+// to are simply replaced.
+template <typename T>
+class TripleBuffer
+{
+public:
+    T &back()
+    {
+        return slots[backIndex];
+    }
 
-        case 0x4: // 8xy4 - ADD Vx, Vy
+    void publish()
+    {
+        backIndex = middle.exchange(backIndex | FRESH, std::memory_order_acq_rel) & INDEX;
+    }
+
+    // True if front() changed
+    bool acquire()
+    {
+        if (!(middle.load(std::memory_order_acquire) & FRESH))
         {
-            uint16_t sum = V[x] + V[y];
-            V[0xF] = (sum > 0xFF) ? 1 : 0;
-            V[x] = sum & 0xFF;
-            pc += 2;
-            break;
+            return false;
         }
+        frontIndex = middle.exchange(frontIndex, std::memory_order_acq_rel) & INDEX;
+        return true;
+    }
 
-        case 0x5: // 8xy5 - SUB Vx - Vy
-            V[0xF] = (V[x] > V[y]) ? 1 : 0;
-            V[x] -= V[y];
-            pc += 2;
-            break;
+    const T &front() const
+    {
+        return slots[frontIndex];
+    }
 
-        case 0x6: // 8xy6 - Shift right Vx
-            V[0xF] = V[x] & 0x1;
-            V[x] >>= 1;
-            pc += 2;
-            break;
+private:
+    static constexpr uint8_t INDEX = 0x3;
+    static constexpr uint8_t FRESH = 0x4; // Middle holds a value not yet acquired
 
-        case 0x7: // 8xy7 - SUBN Vy - Vx
-            V[0xF] = (V[y] > V[x]) ? 1 : 0;
-            V[x] = V[y] - V[x];
-            pc += 2;
-            break;
+    std::array<T, 3> slots{};
+    uint8_t backIndex = 0; // Writer only
+    alignas(64) std::atomic<uint8_t> middle{1};
+    alignas(64) uint8_t frontIndex = 2; // Reader only
+};
 
-        case 0xE: // 8xyE - shift left Vx
-            V[0xF] = (V[x] & 0x80) >> 7;
-            V[x] <<= 1;
-            pc += 2;
-            break;
+#ifndef CHIP8_HEADLESS
+// Owns the display texture on the render thread. present() uploads the
+// span of rows that differ from the last upload into the Core's
+// DISPLAY_WIDTH x DISPLAY_HEIGHT streaming texture, which the GPU scales to
+// the window in a single copy, then draws the overlay text, if any, on top.
+// A frame identical to the last one is not presented unless the overlay
+// changed.
+template <typename Core>
+class DisplayRenderer
+{
+public:
+    DisplayRenderer(SDL_Renderer *renderer, SDL_Texture *texture) : renderer(renderer), texture(texture)
+    {
+    }
 
-        default:
-            std::cerr << "Unknown 0x8 instruction: 0x" << std::hex << opcode << std::endl;
-            break;
+    // Returns whether anything was presented
+    bool present(const typename Core::Framebuffer &frame)
+    {
+        uint64_t changed = 0;
+        for (int y = 0; y < Core::DISPLAY_HEIGHT; ++y)
+        {
+            for (int plane = 0; plane < Core::PLANES; ++plane)
+            {
+                const int index = plane * Core::DISPLAY_HEIGHT + y;
+                if (!uploadedValid || frame[index] != uploaded[index])
+                {
+                    changed |= uint64_t(1) << y;
+                }
+            }
         }
-        break;
-    case 0x9000: // 9xy0 - skip if Vx != Vy
-        if (V[(opcode & 0x0F00) >> 8] != V[(opcode & 0x00F0) >> 4])
+        if (changed == 0)
         {
-            pc += 4;
+            if (overlayChanged)
+            {
+                finish();
+                return true;
+            }
+            return false;
         }
-        else
+
+        // Locked texels are write-only, so every row in the span is rewritten
+        const int first = __builtin_ctzll(changed);
+        const int last = 63 - __builtin_clzll(changed);
+        const SDL_Rect span = {0, first, Core::DISPLAY_WIDTH, last - first + 1};
+        void *pixels = nullptr;
+        int pitch = 0;
+        if (SDL_LockTexture(texture, &span, &pixels, &pitch) < 0)
         {
-            pc += 2;
+            std::cerr << "Failed to lock display texture: " << SDL_GetError() << std::endl;
+            return false;
         }
-        break;
-    case 0xA000: // Annn - set I to nnn
-        I = opcode & 0x0FFF;
-        pc += 2;
-        break;
-    case 0xB000: // Bnn - Jump to nnn + v[0]
-        pc = (opcode & 0x0FFF) + V[0];
-        break;
-    case 0xC000: // Cxkk - Vx = rand byte under 255 AND kk
-        V[(opcode & 0x0F00) >> 8] = (rand() % 256) & (opcode & 0x00FF);
-        pc += 2;
-        break;
-    case 0xD000: // Dxyn
-    // Refer Technical reference
-    {
-        uint8_t x = V[(opcode & 0x0F00) >> 8] % DISPLAY_WIDTH;
-        uint8_t y = V[(opcode & 0x00F0) >> 4] % DISPLAY_HEIGHT;
-        uint8_t height = opcode & 0x000F;
-        V[0xF] = 0;
 
-        for (int row = 0; row < height; ++row)
+        for (int y = first; y <= last; ++y)
         {
-            uint8_t sprite = memory[I + row];
-            for (int col = 0; col < 8; ++col)
+            uint32_t *row = reinterpret_cast<uint32_t *>(static_cast<uint8_t *>(pixels) + (y - first) * pitch);
+            std::array<typename Core::Row, Core::PLANES> bits;
+            for (int plane = 0; plane < Core::PLANES; ++plane)
             {
-                if (sprite & (0x80 >> col))
+                bits[plane] = frame[plane * Core::DISPLAY_HEIGHT + y];
+                uploaded[plane * Core::DISPLAY_HEIGHT + y] = bits[plane];
+            }
+            for (int x = 0; x < Core::DISPLAY_WIDTH; ++x)
+            {
+                unsigned color = 0;
+                for (int plane = 0; plane < Core::PLANES; ++plane)
                 {
-                    size_t index = (y + row) * DISPLAY_WIDTH + (x + col);
-                    if (display[index] == 1)
-                    {
-                        V[0xF] = 1;
-                    }
-                    display[index] ^= 1;
+                    color |= static_cast<unsigned>(bits[plane] >> (Core::DISPLAY_WIDTH - 1)) << plane;
+                    bits[plane] <<= 1;
                 }
+                row[x] = PLANE_COLORS[color];
             }
         }
+        uploadedValid = true;
 
-        drawFlag = true;
-        pc += 2;
-        break;
+        SDL_UnlockTexture(texture);
+        finish();
+        return true;
     }
-    case 0xE000:
-        switch (opcode & 0x00FF)
+
+    // Makes the next present() upload and present everything, e.g. after
+    // the window contents were lost
+    void redrawAll()
+    {
+        uploadedValid = false;
+    }
+
+    // Text drawn in the top-left corner from the next present() on; empty
+    // hides the overlay
+    void setOverlay(std::vector<std::string> lines)
+    {
+        overlayChanged |= lines != overlay;
+        overlay = std::move(lines);
+    }
+
+    bool overlayPending() const
+    {
+        return overlayChanged;
+    }
+
+private:
+    SDL_Renderer *renderer;
+    SDL_Texture *texture;
+    typename Core::Framebuffer uploaded{}; // Rows as last uploaded
+    bool uploadedValid = false;
+    std::vector<std::string> overlay;
+    bool overlayChanged = false;
+
+    void finish()
+    {
+        SDL_RenderCopy(renderer, texture, nullptr, nullptr);
+        drawOverlay();
+        SDL_RenderPresent(renderer);
+        overlayChanged = false;
+    }
+
+    // 3x5 glyphs, one row per entry, bit 2 leftmost. Covers the digits and
+    // the letters the metrics labels use; anything else is blank.
+    static const uint8_t *glyph(char c)
+    {
+        static const struct
         {
-        case 0x009E: // Skip next instruction if key value with Vx is pressed
-            if (keypad[V[(opcode & 0x0F00) >> 8]])
-            {
-                pc += 4;
-            }
-            else
-            {
-                pc += 2;
-            }
-            break;
-        case 0x00A1: // Skip next instruction if Key value with Vx is not pressed
-            if (!keypad[V[(opcode & 0x0F00) >> 8]])
-            {
-                pc += 4;
-            }
-            else
+            char c;
+            uint8_t rows[5];
+        } glyphs[] = {
+            {'0', {7, 5, 5, 5, 7}}, {'1', {2, 6, 2, 2, 7}}, {'2', {7, 1, 7, 4, 7}}, {'3', {7, 1, 7, 1, 7}},
+            {'4', {5, 5, 7, 1, 1}}, {'5', {7, 4, 7, 1, 7}}, {'6', {7, 4, 7, 5, 7}}, {'7', {7, 1, 1, 1, 1}},
+            {'8', {7, 5, 7, 5, 7}}, {'9', {7, 5, 7, 1, 7}}, {'.', {0, 0, 0, 0, 2}}, {'E', {7, 4, 7, 4, 7}},
+            {'F', {7, 4, 7, 4, 4}}, {'I', {7, 2, 2, 2, 7}}, {'K', {5, 6, 4, 6, 5}}, {'M', {5, 7, 7, 5, 5}},
+            {'N', {6, 5, 5, 5, 5}}, {'O', {7, 5, 5, 5, 7}}, {'P', {7, 5, 7, 4, 4}}, {'R', {7, 5, 6, 5, 5}},
+            {'S', {7, 4, 7, 1, 7}}, {'U', {5, 5, 5, 5, 7}}, {'V', {5, 5, 5, 5, 2}},
+        };
+        for (const auto &entry : glyphs)
+        {
+            if (entry.c == c)
             {
-                pc += 2;
+                return entry.rows;
             }
-            break;
         }
-        break;
-    case 0xF000:
-        switch (opcode & 0x00FF)
+        return nullptr;
+    }
+
+    void drawOverlay()
+    {
+        if (overlay.empty())
         {
-        case 0x07: // Fx07 - Vx = delayTimer
-            V[(opcode & 0x0F00) >> 8] = delayTimer;
-            pc += 2;
-            break;
+            return;
+        }
 
-        case 0x0A: // Store value of key in Vx after waiting for key press
+        SDL_SetRenderDrawColor(renderer, (OVERLAY_COLOR >> 16) & 0xFF, (OVERLAY_COLOR >> 8) & 0xFF, OVERLAY_COLOR & 0xFF,
+                               OVERLAY_COLOR >> 24);
+        std::vector<SDL_Rect> dots;
+        for (size_t line = 0; line < overlay.size(); ++line)
         {
-            bool keyPressed = false;
-            for (int i = 0; i < KEYPAD_SIZE; ++i)
+            for (size_t column = 0; column < overlay[line].size(); ++column)
             {
-                if (keypad[i])
+                const uint8_t *rows = glyph(overlay[line][column]);
+                for (int y = 0; rows && y < 5; ++y)
                 {
-                    V[(opcode & 0x0F00) >> 8] = i;
-                    keyPressed = true;
-                    break;
+                    for (int x = 0; x < 3; ++x)
+                    {
+                        if (rows[y] & (4 >> x))
+                        {
+                            dots.push_back(SDL_Rect{static_cast<int>(1 + column * 4 + x) * OVERLAY_DOT,
+                                                    static_cast<int>(1 + line * 6 + y) * OVERLAY_DOT, OVERLAY_DOT,
+                                                    OVERLAY_DOT});
+                        }
+                    }
                 }
             }
-            if (!keyPressed)
-            {
-                return;
-            }
-            pc += 2;
-            break;
         }
+        SDL_RenderFillRects(renderer, dots.data(), static_cast<int>(dots.size()));
+    }
+};
 
-        case 0x15: // Fx15 - set delayTimer to Vx
-            delayTimer = V[(opcode & 0x0F00) >> 8];
-            pc += 2;
-            break;
+// Written by the event thread, read by the emulation thread
+struct EmulatorControls
+{
+    std::atomic<bool> running{true};
+    std::atomic<bool> turbo{false};
+    std::atomic<bool> rewinding{false};
+    std::atomic<bool> saveRequested{false};
+    std::atomic<bool> loadRequested{false};
+    KeyEventQueue input;
+    WakeSignal wake; // Notified after any change above
+};
 
-        case 0x18: // Fx18 - set sounTimer to Vx
-            soundTimer = V[(opcode & 0x0F00) >> 8];
-            pc += 2;
-            break;
+// Written by the emulation thread after every loop iteration, read by the
+// event thread for metrics. Each is a running total.
+struct EmulationCounters
+{
+    std::atomic<unsigned long long> cycles{0};
+    std::atomic<unsigned long long> frames{0};
+    std::atomic<unsigned long long> sleeps{0};
+    std::atomic<long long> oversleepNs{0};
 
-        case 0x1E: // Fx1E - I = I + Vx, location of sprite for Vx
-            I += V[(opcode & 0x0F00) >> 8];
-            pc += 2;
-            break;
+    void update(const FrameScheduler &scheduler)
+    {
+        cycles.store(scheduler.cyclesRun(), std::memory_order_relaxed);
+        frames.store(scheduler.framesRun(), std::memory_order_relaxed);
+        sleeps.store(scheduler.framesSlept(), std::memory_order_relaxed);
+        oversleepNs.store(std::chrono::duration_cast<std::chrono::nanoseconds>(scheduler.oversleep()).count(),
+                          std::memory_order_relaxed);
+    }
+};
 
-        case 0x29: // Fx29 - Set location of sprite for digit Vx
-            I = V[(opcode & 0x0F00) >> 8] * 5;
-            pc += 2;
-            break;
+// Per-interval performance figures, kept by the event thread: emulation
+// speed from EmulationCounters, presentation from present() timings.
+// Each sample() covers the time since the previous one.
+class RuntimeMetrics
+{
+public:
+    using Clock = std::chrono::steady_clock;
 
-        case 0x33: // Store BCD of Vx in I, I+1, I+2
-        {
-            uint8_t value = V[(opcode & 0x0F00) >> 8];
-            memory[I] = value / 100;
-            memory[I + 1] = (value / 10) % 10;
-            memory[I + 2] = value % 10;
-            pc += 2;
-            break;
-        }
+    // Upper bounds, in ms, of the present-interval histogram buckets;
+    // the last bucket takes everything slower
+    static constexpr std::array<int, 4> INTERVAL_BOUNDS = {{8, 17, 25, 34}};
+
+    struct Sample
+    {
+        double seconds = 0; // Since the start of the run
+        double mips = 0;
+        unsigned long long frames = 0;    // Emulated
+        unsigned long long presented = 0; // Emulated frames that reached the screen
+        unsigned long long skipped = 0;   // Emulated frames that did not
+        double renderMeanUs = 0;
+        double renderMaxUs = 0;
+        double oversleepMeanUs = 0;
+        std::array<unsigned long long, INTERVAL_BOUNDS.size() + 1> intervals{};
+    };
 
-        case 0x55: // Fx55 - Store V0 to Vx starting at location I 
+    explicit RuntimeMetrics(Clock::time_point start) : started(start), last(start)
+    {
+    }
+
+    void presented(Clock::time_point at, Clock::duration render)
+    {
+        ++presents;
+        const double us = std::chrono::duration<double, std::micro>(render).count();
+        renderUs += us;
+        renderMaxUs = std::max(renderMaxUs, us);
+        if (lastPresent != Clock::time_point{})
         {
-            uint8_t x = (opcode & 0x0F00) >> 8;
-            for (uint8_t i = 0; i <= x; ++i)
+            const double ms = std::chrono::duration<double, std::milli>(at - lastPresent).count();
+            size_t bucket = 0;
+            while (bucket < INTERVAL_BOUNDS.size() && ms >= INTERVAL_BOUNDS[bucket])
             {
-                memory[I + i] = V[i];
+                ++bucket;
             }
-            pc += 2;
-            break;
+            ++intervals[bucket];
         }
+        lastPresent = at;
+    }
+
+    Sample sample(Clock::time_point now, const EmulationCounters &counters)
+    {
+        const unsigned long long cycles = counters.cycles.load(std::memory_order_relaxed);
+        const unsigned long long frames = counters.frames.load(std::memory_order_relaxed);
+        const unsigned long long sleeps = counters.sleeps.load(std::memory_order_relaxed);
+        const long long oversleepNs = counters.oversleepNs.load(std::memory_order_relaxed);
+        const double elapsed = std::chrono::duration<double>(now - last).count();
 
-        case 0x65: // Fx65 - Read from memory at I into registers from V0 to Vx
+        Sample result;
+        result.seconds = std::chrono::duration<double>(now - started).count();
+        result.mips = elapsed > 0 ? (cycles - lastCycles) / elapsed / 1e6 : 0;
+        result.frames = frames - lastFrames;
+        result.presented = std::min(presents, result.frames);
+        result.skipped = result.frames - result.presented;
+        result.renderMeanUs = presents == 0 ? 0 : renderUs / presents;
+        result.renderMaxUs = renderMaxUs;
+        result.oversleepMeanUs = sleeps == lastSleeps ? 0 : (oversleepNs - lastOversleepNs) / 1e3 / (sleeps - lastSleeps);
+        result.intervals = intervals;
+
+        last = now;
+        lastCycles = cycles;
+        lastFrames = frames;
+        lastSleeps = sleeps;
+        lastOversleepNs = oversleepNs;
+        presents = 0;
+        renderUs = 0;
+        renderMaxUs = 0;
+        intervals.fill(0);
+        return result;
+    }
+
+    static void writeJson(std::ostream &out, const Sample &sample)
+    {
+        out << std::fixed << std::setprecision(3) << "{\"t\":" << sample.seconds << std::setprecision(6)
+            << ",\"mips\":" << sample.mips << ",\"frames\":" << sample.frames << ",\"presented\":" << sample.presented
+            << ",\"skipped\":" << sample.skipped << std::setprecision(1) << ",\"render_us_mean\":" << sample.renderMeanUs
+            << ",\"render_us_max\":" << sample.renderMaxUs << ",\"oversleep_us_mean\":" << sample.oversleepMeanUs
+            << ",\"present_interval_ms\":{";
+        for (size_t bucket = 0; bucket < sample.intervals.size(); ++bucket)
         {
-            uint8_t x = (opcode & 0x0F00) >> 8;
-            for (uint8_t i = 0; i <= x; ++i)
+            out << (bucket == 0 ? "" : ",") << '"';
+            if (bucket < INTERVAL_BOUNDS.size())
             {
-                V[i] = memory[I + i];
+                out << '<' << INTERVAL_BOUNDS[bucket];
             }
-            pc += 2;
-            break;
+            else
+            {
+                out << ">=" << INTERVAL_BOUNDS.back();
+            }
+            out << "\":" << sample.intervals[bucket];
         }
+        out << "}}" << std::endl;
+    }
 
-        default:
-            std::cerr << "Unknown 0xF instruction: 0x" << std::hex << opcode << std::endl;
-            break;
-        }
-        break;
-    default:
-        std::cerr << "Unknown opcode: 0x" << std::hex << opcode << std::endl;
-        break;
+    // Lines for DisplayRenderer::setOverlay, in the characters it can draw
+    static std::vector<std::string> overlayLines(const Sample &sample)
+    {
+        std::ostringstream mips, frames, render, oversleep;
+        mips << "MIPS " << std::fixed << std::setprecision(sample.mips < 1 ? 4 : 2) << sample.mips;
+        frames << "FPS " << sample.presented << " SKIP " << sample.skipped;
+        render << "REN " << static_cast<long>(sample.renderMeanUs) << " US";
+        oversleep << "OVR " << static_cast<long>(sample.oversleepMeanUs) << " US";
+        return {mips.str(), frames.str(), render.str(), oversleep.str()};
     }
-}
 
-void Chip8::emulateCycle()
+private:
+    Clock::time_point started;
+    Clock::time_point last;
+    Clock::time_point lastPresent{};
+    unsigned long long lastCycles = 0;
+    unsigned long long lastFrames = 0;
+    unsigned long long lastSleeps = 0;
+    long long lastOversleepNs = 0;
+    unsigned long long presents = 0;
+    double renderUs = 0;
+    double renderMaxUs = 0;
+    std::array<unsigned long long, INTERVAL_BOUNDS.size() + 1> intervals{};
+};
+
+// What the emulation thread hands to the event thread per published frame
+template <typename Core>
+struct PublishedFrame
 {
-    uint16_t opcode = fetchOpcode();
-    executeOpcode(opcode);
+    typename Core::Framebuffer pixels{};
+    uint64_t sequence = 0;
+    // Oldest key event applied since the last published frame, if any
+    bool hasInput = false;
+    std::chrono::steady_clock::time_point inputAt;
+};
 
-    if (delayTimer > 0)
+// Key event to present times, measured on the event thread once the
+// present that first shows a frame emulated after the event returns (with
+// --vsync, once it is on screen). Events that change nothing on screen
+// within LATENCY_WINDOW_FRAMES are not counted.
+class LatencyStats
+{
+public:
+    void add(std::chrono::steady_clock::duration latency)
     {
-        --delayTimer;
+        const double ms = std::chrono::duration<double, std::milli>(latency).count();
+        ++samples;
+        totalMs += ms;
+        worstMs = std::max(worstMs, ms);
     }
 
-    if (soundTimer > 0)
+    void print(std::ostream &out) const
     {
-        --soundTimer;
+        out << "Input latency: " << samples << " samples";
+        if (samples > 0)
+        {
+            out << std::fixed << std::setprecision(2) << ", mean " << totalMs / samples << " ms, worst " << worstMs << " ms";
+        }
+        out << std::endl;
     }
-}
 
-void Chip8::renderDisplay(SDL_Renderer *renderer)
+private:
+    unsigned long long samples = 0;
+    double totalMs = 0;
+    double worstMs = 0;
+};
+
+// Square-wave beeper driven by the sound timer. The emulation loop pushes
+// one on/off entry per 60 Hz tick; SDL's audio thread turns each into
+// 1/60 s of samples. The queue is the only thing shared, so a slow frame
+// never stalls the audio thread and a late callback never stalls the
+// core: a full queue drops the tick, an empty one holds the tone briefly
+// and then falls silent.
+class BeepAudio
 {
-    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-    SDL_RenderClear(renderer);
+public:
+    BeepAudio() = default;
+    BeepAudio(const BeepAudio &) = delete;
+    BeepAudio &operator=(const BeepAudio &) = delete;
+
+    ~BeepAudio()
+    {
+        close();
+    }
 
-    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+    // A larger buffer survives longer host stalls at the cost of latency
+    bool open(int bufferSamples)
+    {
+        SDL_AudioSpec want{};
+        want.freq = AUDIO_SAMPLE_RATE;
+        want.format = AUDIO_S16SYS;
+        want.channels = 1;
+        want.samples = static_cast<Uint16>(bufferSamples);
+        want.callback = &BeepAudio::fill;
+        want.userdata = this;
 
-    for (int y = 0; y < DISPLAY_HEIGHT; ++y)
+        device = SDL_OpenAudioDevice(nullptr, 0, &want, nullptr, 0);
+        if (device == 0)
+        {
+            std::cerr << "Failed to open audio device: " << SDL_GetError() << std::endl;
+            return false;
+        }
+        SDL_PauseAudioDevice(device, 0);
+        return true;
+    }
+
+    // Must run before SDL_Quit
+    void close()
     {
-        for (int x = 0; x < DISPLAY_WIDTH; ++x)
+        if (device != 0)
+        {
+            SDL_CloseAudioDevice(device);
+            device = 0;
+        }
+    }
+
+    void pushTick(bool on)
+    {
+        if (device != 0)
+        {
+            ticks.push(on);
+        }
+    }
+
+private:
+    SDL_AudioDeviceID device = 0;
+    SpscRing<bool, 16> ticks;
+
+    // Audio thread only
+    int samplesLeft = 0; // In the current tick
+    int missedTicks = 0;
+    bool toneOn = false;
+    int phase = 0; // Square wave position, in units of 1/AUDIO_SAMPLE_RATE cycles
+
+    static void fill(void *userdata, Uint8 *stream, int length)
+    {
+        BeepAudio &audio = *static_cast<BeepAudio *>(userdata);
+        int16_t *samples = reinterpret_cast<int16_t *>(stream);
+        for (int i = 0; i < length / static_cast<int>(sizeof(int16_t)); ++i)
         {
-            if (display[y * DISPLAY_WIDTH + x])
+            if (audio.samplesLeft == 0)
             {
-                SDL_Rect pixel = {x * PIXEL_SCALE, y * PIXEL_SCALE, PIXEL_SCALE, PIXEL_SCALE};
-                SDL_RenderFillRect(renderer, &pixel);
+                bool on = false;
+                if (audio.ticks.pop(on))
+                {
+                    audio.toneOn = on;
+                    audio.missedTicks = 0;
+                }
+                else if (++audio.missedTicks > AUDIO_HOLD_TICKS)
+                {
+                    audio.toneOn = false;
+                }
+                audio.samplesLeft = AUDIO_SAMPLE_RATE / FRAME_RATE;
             }
+            --audio.samplesLeft;
+
+            audio.phase = (audio.phase + BEEP_HZ) % AUDIO_SAMPLE_RATE;
+            const int16_t level = audio.phase < AUDIO_SAMPLE_RATE / 2 ? BEEP_AMPLITUDE : -BEEP_AMPLITUDE;
+            samples[i] = audio.toneOn ? level : 0;
         }
     }
+};
 
-    SDL_RenderPresent(renderer);
-    drawFlag = false;
-}
-
-void Chip8::setKeyState(uint8_t key, bool pressed)
+template <typename Machine>
+static int runSdl(const Options &options)
 {
-    if (key < KEYPAD_SIZE)
+    using Core = BasicChip8<Machine>;
+    const auto core = std::make_unique<Core>(options.seed);
+    Core &chip8 = *core;
+    if (!chip8.loadROM(options.romPath))
     {
-        keypad[key] = pressed;
+        return 1;
     }
-}
 
-int main(int argc, char *argv[])
-{
-    if (argc != 2)
+    // A log is a function of cycle counts only, so it needs fixed-size
+    // frames and a single timeline with no rewinds or state loads.
+    InputRecorder recorder;
+    const bool recording = !options.recordPath.empty();
+    if (recording && options.cpuHz == 0)
+    {
+        std::cerr << "--record needs a fixed --cpu-hz" << std::endl;
+        return 1;
+    }
+    if (recording && !recorder.open(options.recordPath, options))
     {
-        std::cerr << "Usage: " << argv[0] << " <ROM file>" << std::endl;
         return 1;
     }
 
+    std::ofstream metricsFile;
+    std::ostream *metricsOut = nullptr;
+    if (options.metricsPath == "-")
+    {
+        metricsOut = &std::cerr;
+    }
+    else if (!options.metricsPath.empty())
+    {
+        metricsFile.open(options.metricsPath, std::ios::app);
+        if (!metricsFile)
+        {
+            std::cerr << "Failed to open metrics output: " << options.metricsPath << std::endl;
+            return 1;
+        }
+        metricsOut = &metricsFile;
+    }
+
     if (SDL_Init(SDL_INIT_EVERYTHING) < 0)
     {
         std::cerr << "Failed to initialize SDL: " << SDL_GetError() << std::endl;
         return 1;
     }
 
+    // Posted by the emulation thread when it publishes a frame
+    const Uint32 frameEvent = SDL_RegisterEvents(1);
+    if (frameEvent == static_cast<Uint32>(-1))
+    {
+        std::cerr << "Failed to register SDL event: " << SDL_GetError() << std::endl;
+        SDL_Quit();
+        return 1;
+    }
+
     SDL_Window *window = SDL_CreateWindow("CHIP-8 Emulator", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, DISPLAY_WIDTH * PIXEL_SCALE, DISPLAY_HEIGHT * PIXEL_SCALE, SDL_WINDOW_SHOWN);
     if (!window)
     {
@@ -491,7 +5743,8 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    const Uint32 rendererFlags = SDL_RENDERER_ACCELERATED | (options.vsync ? SDL_RENDERER_PRESENTVSYNC : 0);
+    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, rendererFlags);
     if (!renderer)
     {
         std::cerr << "Failed to create SDL renderer: " << SDL_GetError() << std::endl;
@@ -500,90 +5753,401 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    Chip8 chip8;
-    chip8.loadROM(argv[1]);
+    SDL_Texture *texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, Core::DISPLAY_WIDTH,
+                                             Core::DISPLAY_HEIGHT);
+    if (!texture)
+    {
+        std::cerr << "Failed to create SDL texture: " << SDL_GetError() << std::endl;
+        SDL_DestroyRenderer(renderer);
+        SDL_DestroyWindow(window);
+        SDL_Quit();
+        return 1;
+    }
+
+    BeepAudio audio;
+    if (options.audioBuffer > 0)
+    {
+        audio.open(options.audioBuffer); // Runs silent if there is no device
+    }
+
+    // The emulation thread owns chip8, the scheduler, rewind history, the
+    // recorder and the audio producer side. This thread only handles SDL
+    // events and presents, so a present blocked on vsync or the compositor
+    // never delays emulation. Key events are timestamped here and applied
+    // by the emulation thread at the matching cycle (runFramePaced).
+#ifdef CHIP8_PROFILE
+    const std::unique_ptr<InstructionProfile> profile = attachProfile(options, chip8);
+#endif
+    EmulatorControls controls;
+    controls.turbo = options.turbo;
+    EmulationCounters counters;
+    TripleBuffer<PublishedFrame<Core>> frames;
+    std::atomic<bool> frameSignalled{false}; // A frameEvent is queued and not yet handled
+    const int rewindMb = recording ? 0 : options.rewindMb;
+
+    std::thread emulation([&]() {
+        FrameScheduler scheduler(options.cpuHz);
+        BasicSnapshotRing<Machine> history(SIZE_MAX, static_cast<size_t>(rewindMb) << 20);
+        bool turbo = options.turbo;
+        uint64_t published = 0;
+        bool inputPending = false;
+        std::chrono::steady_clock::time_point inputAt;
+        int inputFrames = 0; // Frames since inputAt with nothing published
+
+        auto onInput = [&](const KeyEvent &event) {
+            recorder.update(scheduler.cyclesRun(), event.keys);
+            if (!inputPending)
+            {
+                inputPending = true;
+                inputAt = event.at;
+                inputFrames = 0;
+            }
+        };
+
+        while (controls.running)
+        {
+            const uint64_t seen = controls.wake.count();
+            if (turbo && !controls.turbo)
+            {
+                scheduler.resync();
+            }
+            turbo = controls.turbo;
+            const bool rewinding = rewindMb > 0 && controls.rewinding;
+            if (controls.saveRequested.exchange(false))
+            {
+                writeStateFile(options.romPath + ".state", chip8);
+            }
+            if (controls.loadRequested.exchange(false))
+            {
+                readStateFile(options.romPath + ".state", chip8);
+            }
+
+            if (rewinding)
+            {
+                scheduler.applyInput(chip8, controls.input, onInput);
+                for (int i = 0; i < options.rewindSpeed; ++i)
+                {
+                    if (!history.rewind(chip8))
+                    {
+                        break;
+                    }
+                }
+            }
+            else
+            {
+                if (turbo)
+                {
+                    scheduler.applyInput(chip8, controls.input, onInput);
+                    scheduler.runTurbo(chip8, options.frameskip);
+                }
+                else
+                {
+                    scheduler.runFramePaced(chip8, controls.input, controls.wake, onInput);
+                }
+
+                // One snapshot per loop iteration: every frame in real time,
+                // every presented frame in turbo
+                if (rewindMb > 0)
+                {
+                    history.capture(chip8);
+                }
+            }
+
+            // One tick per loop iteration: a frame in real time, a present in turbo
+            audio.pushTick(!rewinding && chip8.soundActive());
+
+            if (chip8.shouldDraw())
+            {
+                PublishedFrame<Core> &frame = frames.back();
+                frame.pixels = chip8.framebuffer();
+                frame.sequence = ++published;
+                frame.hasInput = inputPending;
+                frame.inputAt = inputAt;
+                frames.publish();
+                chip8.markDrawn();
+                inputPending = false;
+                if (!frameSignalled.exchange(true))
+                {
+                    SDL_Event notice{};
+                    notice.type = frameEvent;
+                    SDL_PushEvent(&notice);
+                }
+            }
+            else if (inputPending && ++inputFrames > LATENCY_WINDOW_FRAMES)
+            {
+                inputPending = false;
+            }
+
+            if (!turbo)
+            {
+                // Sleeping through a beep would starve the audio queue
+                const unsigned idle = rewinding || chip8.soundActive() ? 0 : chip8.idleFrames();
+                if (idle > 0)
+                {
+                    scheduler.sleepIdle(chip8, idle, controls.wake, seen);
+                }
+                else
+                {
+                    scheduler.waitForNextFrame();
+                }
+            }
+
+            counters.update(scheduler);
+        }
+
+        recorder.close(scheduler.cyclesRun());
+    });
 
-    bool running = true;
+    using Clock = std::chrono::steady_clock;
+    DisplayRenderer<Core> display(renderer, texture);
+    LatencyStats latency;
+    uint64_t measured = 0; // Sequence of the last frame counted in latency
+    RuntimeMetrics metrics(Clock::now());
+    bool overlayShown = options.overlay;
+    Clock::time_point nextSample = Clock::now() + std::chrono::milliseconds(METRICS_INTERVAL_MS);
+    uint16_t keys = 0;
+    auto setKey = [&keys](uint8_t key, bool pressed) {
+        keys = pressed ? keys | (1u << key) : keys & ~(1u << key);
+    };
     SDL_Event event;
 
-    while (running)
+    while (controls.running)
     {
-        while (SDL_PollEvent(&event))
+        // Metrics need a wake-up every interval; otherwise only events matter
+        const bool sampling = overlayShown || metricsOut;
+        int pending = 0;
+        if (sampling)
+        {
+            const auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(nextSample - Clock::now()).count();
+            pending = SDL_WaitEventTimeout(&event, static_cast<int>(std::max<long long>(wait, 0)));
+        }
+        else if (!(pending = SDL_WaitEvent(&event)))
+        {
+            std::cerr << "Failed to wait for SDL events: " << SDL_GetError() << std::endl;
+            break;
+        }
+
+        bool redraw = false;
+        for (; pending; pending = SDL_PollEvent(&event))
         {
             if (event.type == SDL_QUIT)
             {
-                running = false;
+                controls.running = false;
+            }
+            else if (event.type == frameEvent)
+            {
+                frameSignalled = false;
+            }
+            else if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_EXPOSED)
+            {
+                display.redrawAll();
+                redraw = true;
             }
             else if (event.type == SDL_KEYDOWN || event.type == SDL_KEYUP)
             {
                 bool pressed = event.type == SDL_KEYDOWN;
+                const uint16_t before = keys;
                 switch (event.key.keysym.sym)
                 {
+                case SDLK_TAB:
+                    if (pressed && !event.key.repeat)
+                    {
+                        controls.turbo = !controls.turbo;
+                    }
+                    break;
+                case SDLK_BACKSPACE:
+                    controls.rewinding = pressed;
+                    break;
+                case SDLK_F1:
+                    if (pressed && !event.key.repeat)
+                    {
+                        overlayShown = !overlayShown;
+                        if (overlayShown)
+                        {
+                            nextSample = Clock::now();
+                        }
+                        else
+                        {
+                            display.setOverlay({});
+                        }
+                    }
+                    break;
+                case SDLK_F5:
+                    if (pressed && !event.key.repeat)
+                    {
+                        controls.saveRequested = true;
+                    }
+                    break;
+                case SDLK_F9:
+                    if (pressed && !event.key.repeat && !recording)
+                    {
+                        controls.loadRequested = true;
+                    }
+                    break;
                 case SDLK_1:
-                    chip8.setKeyState(0x1, pressed);
+                    setKey(0x1, pressed);
                     break;
                 case SDLK_2:
-                    chip8.setKeyState(0x2, pressed);
+                    setKey(0x2, pressed);
                     break;
                 case SDLK_3:
-                    chip8.setKeyState(0x3, pressed);
+                    setKey(0x3, pressed);
                     break;
                 case SDLK_4:
-                    chip8.setKeyState(0xC, pressed);
+                    setKey(0xC, pressed);
                     break;
                 case SDLK_q:
-                    chip8.setKeyState(0x4, pressed);
+                    setKey(0x4, pressed);
                     break;
                 case SDLK_w:
-                    chip8.setKeyState(0x5, pressed);
+                    setKey(0x5, pressed);
                     break;
                 case SDLK_e:
-                    chip8.setKeyState(0x6, pressed);
+                    setKey(0x6, pressed);
                     break;
                 case SDLK_r:
-                    chip8.setKeyState(0xD, pressed);
+                    setKey(0xD, pressed);
                     break;
                 case SDLK_a:
-                    chip8.setKeyState(0x7, pressed);
+                    setKey(0x7, pressed);
                     break;
                 case SDLK_s:
-                    chip8.setKeyState(0x8, pressed);
+                    setKey(0x8, pressed);
                     break;
                 case SDLK_d:
-                    chip8.setKeyState(0x9, pressed);
+                    setKey(0x9, pressed);
                     break;
                 case SDLK_f:
-                    chip8.setKeyState(0xE, pressed);
+                    setKey(0xE, pressed);
                     break;
                 case SDLK_z:
-                    chip8.setKeyState(0xA, pressed);
+                    setKey(0xA, pressed);
                     break;
                 case SDLK_x:
-                    chip8.setKeyState(0x0, pressed);
+                    setKey(0x0, pressed);
                     break;
                 case SDLK_c:
-                    chip8.setKeyState(0xB, pressed);
+                    setKey(0xB, pressed);
                     break;
                 case SDLK_v:
-                    chip8.setKeyState(0xF, pressed);
+                    setKey(0xF, pressed);
                     break;
                 }
+                if (keys != before)
+                {
+                    controls.input.push(KeyEvent{std::chrono::steady_clock::now(), keys});
+                }
+                controls.wake.notify();
             }
         }
 
-        chip8.emulateCycle();
+        if (sampling && Clock::now() >= nextSample)
+        {
+            const RuntimeMetrics::Sample sample = metrics.sample(Clock::now(), counters);
+            if (metricsOut)
+            {
+                RuntimeMetrics::writeJson(*metricsOut, sample);
+            }
+            if (overlayShown)
+            {
+                display.setOverlay(RuntimeMetrics::overlayLines(sample));
+            }
+            nextSample = Clock::now() + std::chrono::milliseconds(METRICS_INTERVAL_MS);
+        }
 
-        if (chip8.shouldDraw())
+        const bool fresh = frames.acquire();
+        if (fresh || redraw || display.overlayPending())
         {
-            chip8.renderDisplay(renderer);
+            const PublishedFrame<Core> &frame = frames.front();
+            const Clock::time_point began = Clock::now();
+            const bool shown = display.present(frame.pixels);
+            const Clock::time_point done = Clock::now();
+            if (shown && fresh)
+            {
+                metrics.presented(done, done - began);
+            }
+            if (frame.hasInput && frame.sequence != measured)
+            {
+                latency.add(done - frame.inputAt);
+            }
+            measured = frame.sequence;
         }
+    }
 
-        SDL_Delay(16);
+    controls.running = false;
+    controls.wake.notify();
+    emulation.join();
+    audio.close();
+    if (options.reportLatency)
+    {
+        latency.print(std::cerr);
     }
+#ifdef CHIP8_PROFILE
+    writeProfile(options, profile.get());
+#endif
 
+    SDL_DestroyTexture(texture);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
 
     return 0;
-}
\ No newline at end of file
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    if (!parseOptions(argc, argv, options))
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    // Each manifest entry names its own machine and quirks
+    if (!options.regressPath.empty())
+    {
+        return runRegress(options);
+    }
+
+    // Benchmarks and batch jobs compare against each other and the lockstep
+    // cores, which are classic only
+    if ((options.bench || !options.batchPath.empty()) &&
+        (options.machine != MachineKind::Classic || options.quirks != QuirkSet::Default || !options.quirkDbPath.empty()))
+    {
+        std::cerr << "--machine, --quirks and --quirk-db are not supported with --bench or --batch" << std::endl;
+        return 1;
+    }
+
+    if (options.bench)
+    {
+        return runBench(options);
+    }
+
+    if (!options.batchPath.empty())
+    {
+        return runBatch(options);
+    }
+
+    if (!applyQuirkDatabase(options))
+    {
+        return 1;
+    }
+
+    if (options.analyze)
+    {
+        return withMachine(options, [&](auto machine) { return runAnalyze<decltype(machine)>(options); });
+    }
+
+    if (options.headless)
+    {
+        return withMachine(options, [&](auto machine) { return runHeadless<decltype(machine)>(options); });
+    }
+
+#ifdef CHIP8_HEADLESS
+    std::cerr << "Built without SDL; run with --headless" << std::endl;
+    return 1;
+#else
+    return withMachine(options, [&](auto machine) { return runSdl<decltype(machine)>(options); });
+#endif
+}